@@ -10,11 +10,6 @@ struct BBox {
                             -infinity<Real>()};
 };
 
-struct BBoxWithID {
-    BBox box;
-    int id;
-};
-
 inline bool intersect(const BBox &bbox, Ray r) {
     Real t_min = r.tmin;
     Real t_max = r.tmax;
@@ -31,6 +26,19 @@ inline bool intersect(const BBox &bbox, Ray r) {
     return true;
 }
 
+inline Vector3 centroid(const BBox &box) {
+    return (box.p_max + box.p_min) / Real(2);
+}
+
+inline Real surface_area(const BBox &box) {
+    Vector3 extent = box.p_max - box.p_min;
+    if (extent.x < 0 || extent.y < 0 || extent.z < 0) {
+        // empty box
+        return 0;
+    }
+    return 2 * (extent.x * extent.y + extent.y * extent.z + extent.z * extent.x);
+}
+
 inline int largest_axis(const BBox &box) {
     Vector3 extent = box.p_max - box.p_min;
     if (extent.x > extent.y && extent.x > extent.z) {
@@ -52,4 +60,14 @@ inline BBox merge(const BBox &box1, const BBox &box2) {
         std::max(box1.p_max.y, box2.p_max.y),
         std::max(box1.p_max.z, box2.p_max.z)};
     return BBox{p_min, p_max};
+}
+
+inline bool empty(const BBox &box) {
+    return box.p_min.x > box.p_max.x || box.p_min.y > box.p_max.y || box.p_min.z > box.p_max.z;
+}
+
+// Intersection of two boxes, empty when they do not overlap.
+inline BBox overlap(const BBox &box1, const BBox &box2) {
+    BBox box = BBox{max(box1.p_min, box2.p_min), min(box1.p_max, box2.p_max)};
+    return empty(box) ? BBox{} : box;
 }
\ No newline at end of file
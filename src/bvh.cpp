@@ -1,109 +1,2665 @@
 #include "bvh.h"
+#include <cstring>
 #include <optional>
 #include <variant>
 #include "intersection.h"
+#include "parallel.h"
+#include "utils/flexception.h"
 
-#define BVH_STACK_DEPTH 64
+#define BVH_STACK_DEPTH 128
 
-int construct_bvh(const std::vector<BBoxWithID> &boxes,
-                std::vector<BVHNode> &node_pool) {
-    if (boxes.size() == 1) {
-        BVHNode node;
-        node.left_node_id = node.right_node_id = -1;
-        node.primitive_id = boxes[0].id;
-        node.box = boxes[0].box;
-        node_pool.push_back(node);
-        return node_pool.size() - 1;
+#if defined(__SSE2__) || defined(_M_X64)
+#include <immintrin.h>
+#define TAKE_SSE
+#if defined(__AVX__)
+#define TAKE_AVX
+#endif
+#endif
+
+#define BVH_SAH_BINS 16
+// Relative costs used by the surface area heuristic.
+// A box test is much cheaper than a primitive test (same ratio as pbrt).
+const Real c_bvh_traversal_cost = Real(0.125);
+const Real c_bvh_intersection_cost = Real(1);
+// Testing a PrimitivePack, measured at about two single tests on triangle and sphere scenes.
+const Real c_bvh_pack_intersection_cost = Real(2);
+
+// Ranges with more primitives than this are split by the calling thread, using parallel loops
+// for the bounds, binning and partitioning. Smaller ranges become independent subtree tasks.
+// Neither number depends on the thread count, so the tree is the same for any number of threads.
+const int c_bvh_task_size = 16384;
+const int c_bvh_chunk_size = 4096;
+
+struct BVHBin {
+    BBox box;
+    int count = 0;
+};
+
+struct BVHBins {
+    BVHBin bins[3][BVH_SAH_BINS];
+};
+
+// Both builders work on a single BVHPrimitive array that is partitioned in place.
+// A subtree over n primitives has at most 2n - 1 nodes, stored in post-order,
+// so the slot of every node is known before it is built: the subtree of a range whose first
+// node is node_offset puts its left child's nodes at node_offset, its right child's right after,
+// and its root last. The node pool is sized once up front and subtrees can be filled concurrently.
+// Slots left unused by multi-primitive leaves are compacted away at the end.
+// Node boxes are merged bottom-up from the children, the bounds of a range are only computed
+// top-down when the split method looks at them.
+struct BVHBuildContext {
+    const std::vector<BBox> &boxes;
+    std::vector<BVHPrimitive> &prims;
+    std::vector<BVHPrimitive> &scratch; // used by parallel partitioning of large ranges
+    std::vector<BVHNode> &node_pool;
+    const std::vector<uint32_t> &morton_codes; // sorted and aligned with prims, LBVH only
+    bool needs_bounds;
+    int leaf_block;
+};
+
+using SplitFunc = int (*)(const BVHBuildContext &ctx,
+                          int prim_offset,
+                          int count,
+                          const BBox &big_box,
+                          const BBox &centroid_box);
+
+// Leaves are costed as if their primitives were tested leaf_block at a time. Single primitive leaves are
+// tested on their own (see bvh_intersect_packs).
+static Real leaf_cost(int count, int leaf_block) {
+    if (leaf_block == 1 || count == 1) {
+        return count * c_bvh_intersection_cost;
     }
+    return ((count + leaf_block - 1) / leaf_block) * c_bvh_pack_intersection_cost;
+}
+
+static int num_chunks(int count) {
+    return (count + c_bvh_chunk_size - 1) / c_bvh_chunk_size;
+}
 
-    BBox big_box;
-    for (const BBoxWithID &b : boxes) {
-        big_box = merge(big_box, b.box);
+static void compute_bounds(const BVHBuildContext &ctx,
+                           int prim_offset,
+                           int count,
+                           BBox &big_box,
+                           BBox &centroid_box) {
+    const BVHPrimitive *prims = ctx.prims.data() + prim_offset;
+    auto bound_chunk = [&](int begin, int end, BBox &box, BBox &c_box) {
+        // accumulate in locals, box and c_box could alias ctx.boxes as far as the compiler knows
+        BBox b, c_b;
+        for (int i = begin; i < end; i++) {
+            b = merge(b, ctx.boxes[prims[i].id]);
+            c_b = merge(c_b, BBox{prims[i].centroid, prims[i].centroid});
+        }
+        box = b;
+        c_box = c_b;
+    };
+    if (count <= c_bvh_task_size) {
+        bound_chunk(0, count, big_box, centroid_box);
+        return;
+    }
+    int n = num_chunks(count);
+    std::vector<BBox> chunk_boxes(n), chunk_centroid_boxes(n);
+    parallel_for([&](int64_t c) {
+        bound_chunk(c * c_bvh_chunk_size,
+                    std::min(int(c + 1) * c_bvh_chunk_size, count),
+                    chunk_boxes[c],
+                    chunk_centroid_boxes[c]);
+    }, n);
+    for (int c = 0; c < n; c++) {
+        big_box = merge(big_box, chunk_boxes[c]);
+        centroid_box = merge(centroid_box, chunk_centroid_boxes[c]);
     }
+}
+
+// Split at the median primitive along the largest axis.
+// Returns the number of primitives that go to the left child.
+static int split_median(const BVHBuildContext &ctx,
+                        int prim_offset,
+                        int count,
+                        const BBox &big_box,
+                        const BBox &centroid_box) {
+    UNUSED(centroid_box);
+    BVHPrimitive *prims = ctx.prims.data() + prim_offset;
     int axis = largest_axis(big_box);
-    std::vector<BBoxWithID> local_boxes = boxes;
-    std::sort(local_boxes.begin(), local_boxes.end(),
-        [&](const BBoxWithID &b1, const BBoxWithID &b2) {
-            Vector3 center1 = (b1.box.p_max + b1.box.p_min) / Real(2);
-            Vector3 center2 = (b2.box.p_max + b2.box.p_min) / Real(2);
-            return center1[axis] < center2[axis];
+    int mid = count / 2;
+    std::nth_element(prims, prims + mid, prims + count,
+        [&](const BVHPrimitive &p1, const BVHPrimitive &p2) {
+            return p1.centroid[axis] < p2.centroid[axis];
         });
-    std::vector<BBoxWithID> left_boxes(
-        local_boxes.begin(),
-        local_boxes.begin() + local_boxes.size() / 2);
-    std::vector<BBoxWithID> right_boxes(
-        local_boxes.begin() + local_boxes.size() / 2,
-        local_boxes.end());
+    return mid;
+}
+
+static int bin_index(const BVHPrimitive &p, int axis, Real c_min, Real scale) {
+    return std::min(int((p.centroid[axis] - c_min) * scale), BVH_SAH_BINS - 1);
+}
+
+// Binned SAH split (see pbrt-v3 4.3.2 / Wald 2007).
+// Centroids are projected into BVH_SAH_BINS buckets along each axis and
+// the split plane with the smallest SAH cost among the bucket boundaries is used.
+static int split_sah(const BVHBuildContext &ctx,
+                     int prim_offset,
+                     int count,
+                     const BBox &big_box,
+                     const BBox &centroid_box) {
+    UNUSED(big_box);
+    BVHPrimitive *prims = ctx.prims.data() + prim_offset;
+    Real c_min[3], scale[3];
+    for (int axis = 0; axis < 3; axis++) {
+        c_min[axis] = centroid_box.p_min[axis];
+        Real extent = centroid_box.p_max[axis] - c_min[axis];
+        // all centroids on the same plane means this axis cannot separate anything
+        scale[axis] = extent > 0 ? BVH_SAH_BINS / extent : 0;
+    }
+
+    BVHBins binning;
+    auto &bins = binning.bins;
+    auto bin_chunk = [&](int begin, int end, BVHBins &b) {
+        for (int axis = 0; axis < 3; axis++) {
+            if (scale[axis] == 0) {
+                continue;
+            }
+            for (int i = begin; i < end; i++) {
+                BVHBin &bin = b.bins[axis][bin_index(prims[i], axis, c_min[axis], scale[axis])];
+                bin.count++;
+                bin.box = merge(bin.box, ctx.boxes[prims[i].id]);
+            }
+        }
+    };
+    if (count <= c_bvh_task_size) {
+        bin_chunk(0, count, binning);
+    } else {
+        // Bin every chunk separately then merge in chunk order.
+        int n = num_chunks(count);
+        std::vector<BVHBins> chunk_bins(n);
+        parallel_for([&](int64_t c) {
+            bin_chunk(c * c_bvh_chunk_size,
+                      std::min(int(c + 1) * c_bvh_chunk_size, count),
+                      chunk_bins[c]);
+        }, n);
+        for (int c = 0; c < n; c++) {
+            for (int axis = 0; axis < 3; axis++) {
+                for (int i = 0; i < BVH_SAH_BINS; i++) {
+                    const BVHBin &chunk_bin = chunk_bins[c].bins[axis][i];
+                    bins[axis][i].count += chunk_bin.count;
+                    bins[axis][i].box = merge(bins[axis][i].box, chunk_bin.box);
+                }
+            }
+        }
+    }
+
+    int best_axis = -1;
+    int best_split = -1;
+    Real best_cost = infinity<Real>();
+    for (int axis = 0; axis < 3; axis++) {
+        if (scale[axis] == 0) {
+            continue;
+        }
+        // Sweep from the right to get the area and count of every suffix of bins,
+        // then sweep from the left to evaluate each of the BVH_SAH_BINS - 1 planes.
+        Real right_area[BVH_SAH_BINS];
+        int right_count[BVH_SAH_BINS];
+        BBox right_box;
+        int n = 0;
+        for (int i = BVH_SAH_BINS - 1; i > 0; i--) {
+            right_box = merge(right_box, bins[axis][i].box);
+            n += bins[axis][i].count;
+            right_area[i] = surface_area(right_box);
+            right_count[i] = n;
+        }
+        BBox left_box;
+        n = 0;
+        for (int i = 0; i < BVH_SAH_BINS - 1; i++) {
+            left_box = merge(left_box, bins[axis][i].box);
+            n += bins[axis][i].count;
+            if (n == 0 || right_count[i + 1] == 0) {
+                continue;
+            }
+            Real cost = n * surface_area(left_box) + right_count[i + 1] * right_area[i + 1];
+            if (cost < best_cost) {
+                best_cost = cost;
+                best_axis = axis;
+                best_split = i;
+            }
+        }
+    }
+
+    if (best_axis == -1) {
+        // Every centroid coincides, fall back to splitting the range in halves.
+        return count / 2;
+    }
+    auto goes_left = [&](const BVHPrimitive &p) {
+        return bin_index(p, best_axis, c_min[best_axis], scale[best_axis]) <= best_split;
+    };
+    if (count <= c_bvh_task_size) {
+        return int(std::partition(prims, prims + count, goes_left) - prims);
+    }
+
+    // Parallel stable partition: count the left primitives of every chunk,
+    // scatter all chunks to the scratch buffer at their prefix-sum offsets, then copy back.
+    int n = num_chunks(count);
+    std::vector<int> left_offsets(n + 1, 0), right_offsets(n + 1, 0);
+    parallel_for([&](int64_t c) {
+        int end = std::min(int(c + 1) * c_bvh_chunk_size, count);
+        int left = 0;
+        for (int i = c * c_bvh_chunk_size; i < end; i++) {
+            left += goes_left(prims[i]);
+        }
+        left_offsets[c + 1] = left;
+        right_offsets[c + 1] = end - int(c * c_bvh_chunk_size) - left;
+    }, n);
+    for (int c = 0; c < n; c++) {
+        left_offsets[c + 1] += left_offsets[c];
+        right_offsets[c + 1] += right_offsets[c];
+    }
+    int mid = left_offsets[n];
+    BVHPrimitive *scratch = ctx.scratch.data() + prim_offset;
+    parallel_for([&](int64_t c) {
+        int end = std::min(int(c + 1) * c_bvh_chunk_size, count);
+        int left = left_offsets[c];
+        int right = mid + right_offsets[c];
+        for (int i = c * c_bvh_chunk_size; i < end; i++) {
+            if (goes_left(prims[i])) {
+                scratch[left++] = prims[i];
+            } else {
+                scratch[right++] = prims[i];
+            }
+        }
+    }, n);
+    parallel_for([&](int64_t c) {
+        int end = std::min(int(c + 1) * c_bvh_chunk_size, count);
+        std::copy(scratch + c * c_bvh_chunk_size, scratch + end, prims + c * c_bvh_chunk_size);
+    }, n);
+    return mid;
+}
+
+// Split where the highest bit that differs among the sorted Morton codes of the range flips
+// (Lauterbach et al. 2009, "Fast BVH Construction on GPUs").
+static int split_lbvh(const BVHBuildContext &ctx,
+                      int prim_offset,
+                      int count,
+                      const BBox &big_box,
+                      const BBox &centroid_box) {
+    UNUSED(big_box);
+    UNUSED(centroid_box);
+    const uint32_t *codes = ctx.morton_codes.data() + prim_offset;
+    uint32_t diff = codes[0] ^ codes[count - 1];
+    if (diff == 0) {
+        // Every primitive is in the same Morton cell.
+        return count / 2;
+    }
+    uint32_t mask = 1u << 31;
+    while (!(diff & mask)) {
+        mask >>= 1;
+    }
+    const uint32_t *mid = std::partition_point(codes, codes + count,
+        [&](uint32_t code) { return !(code & mask); });
+    return int(mid - codes);
+}
+
+// Spread the lower 10 bits of x so that there are two zero bits between every bit.
+// From pbrt-v3 4.3.3.
+static uint32_t left_shift3(uint32_t x) {
+    if (x == (1 << 10)) {
+        --x;
+    }
+    x = (x | (x << 16)) & 0b00000011000000000000000011111111;
+    x = (x | (x << 8)) & 0b00000011000000001111000000001111;
+    x = (x | (x << 4)) & 0b00000011000011000011000011000011;
+    x = (x | (x << 2)) & 0b00001001001001001001001001001001;
+    return x;
+}
+
+// v is in [0, 1024]^3
+static uint32_t encode_morton3(const Vector3 &v) {
+    return (left_shift3(uint32_t(v.z)) << 2) | (left_shift3(uint32_t(v.y)) << 1) | left_shift3(uint32_t(v.x));
+}
+
+// Sort ctx.prims by the 30-bit Morton code of their centroid and store the sorted codes in morton_codes.
+// LSD radix sort with 10-bit digits, every pass is a parallel histogram followed by a parallel stable scatter.
+static void sort_morton(const BVHBuildContext &ctx, std::vector<uint32_t> &morton_codes) {
+    constexpr int c_radix_bits = 10;
+    constexpr int c_num_buckets = 1 << c_radix_bits;
+    const int c_radix_chunk_size = 16 * c_bvh_chunk_size;
+    struct MortonPrimitive {
+        uint32_t code;
+        int index;
+    };
+
+    int num_prims = (int)ctx.prims.size();
+    BBox big_box, centroid_box;
+    compute_bounds(ctx, 0, num_prims, big_box, centroid_box);
+    Vector3 extent = centroid_box.p_max - centroid_box.p_min;
+    std::vector<MortonPrimitive> keys(num_prims), sorted_keys(num_prims);
+    parallel_for([&](int64_t i) {
+        Vector3 offset = ctx.prims[i].centroid - centroid_box.p_min;
+        for (int axis = 0; axis < 3; axis++) {
+            if (extent[axis] > 0) {
+                offset[axis] /= extent[axis];
+            }
+        }
+        keys[i] = {encode_morton3(offset * Real(1 << 10)), int(i)};
+    }, num_prims, c_bvh_chunk_size);
+
+    int num_chunks = (num_prims + c_radix_chunk_size - 1) / c_radix_chunk_size;
+    std::vector<int> offsets(num_chunks * c_num_buckets);
+    for (int pass = 0; pass < 30 / c_radix_bits; pass++) {
+        int shift = pass * c_radix_bits;
+        auto digit = [&](const MortonPrimitive &key) {
+            return (key.code >> shift) & (c_num_buckets - 1);
+        };
+        std::fill(offsets.begin(), offsets.end(), 0);
+        parallel_for([&](int64_t c) {
+            int *histogram = offsets.data() + c * c_num_buckets;
+            int end = std::min(int(c + 1) * c_radix_chunk_size, num_prims);
+            for (int i = c * c_radix_chunk_size; i < end; i++) {
+                histogram[digit(keys[i])]++;
+            }
+        }, num_chunks);
+        // Exclusive prefix sum ordered by bucket first and chunk second keeps the sort stable.
+        int sum = 0;
+        for (int b = 0; b < c_num_buckets; b++) {
+            for (int c = 0; c < num_chunks; c++) {
+                int count = offsets[c * c_num_buckets + b];
+                offsets[c * c_num_buckets + b] = sum;
+                sum += count;
+            }
+        }
+        parallel_for([&](int64_t c) {
+            int *offset = offsets.data() + c * c_num_buckets;
+            int end = std::min(int(c + 1) * c_radix_chunk_size, num_prims);
+            for (int i = c * c_radix_chunk_size; i < end; i++) {
+                sorted_keys[offset[digit(keys[i])]++] = keys[i];
+            }
+        }, num_chunks);
+        keys.swap(sorted_keys);
+    }
+
+    morton_codes.resize(num_prims);
+    parallel_for([&](int64_t i) {
+        ctx.scratch[i] = ctx.prims[keys[i].index];
+        morton_codes[i] = keys[i].code;
+    }, num_prims, c_bvh_chunk_size);
+    ctx.prims.swap(ctx.scratch);
+}
+
+// Past this depth every split is a median split, which halves the range and so adds fewer than 32 more levels,
+// so that no tree gets deeper than the traversal stacks (BVH_STACK_DEPTH) however degenerate the input,
+// e.g. boxes growing geometrically from which the SAH splits off one primitive at a time.
+const int c_bvh_max_split_depth = BVH_STACK_DEPTH - 32;
+
+static int split_range(const BVHBuildContext &ctx, SplitFunc split, int depth, int prim_offset, int count) {
+    BBox big_box, centroid_box;
+    if (depth >= c_bvh_max_split_depth) {
+        if (!ctx.needs_bounds) {
+            // Morton order, both halves stay sorted
+            return count / 2;
+        }
+        split = split_median;
+    }
+    if (ctx.needs_bounds) {
+        compute_bounds(ctx, prim_offset, count, big_box, centroid_box);
+    }
+    return split(ctx, prim_offset, count, big_box, centroid_box);
+}
+
+// Build the subtree over prims[prim_offset, prim_offset + count) into
+// node_pool[node_offset, node_offset + 2 * count - 1), its root is the last node of the range.
+// Returns the SAH cost of the subtree relative to the area of its root. Small subtrees that are
+// cheaper as a single leaf are collapsed and the slots of their other nodes are marked unused.
+static Real construct_bvh_recursive(const BVHBuildContext &ctx,
+                                    int prim_offset,
+                                    int count,
+                                    int node_offset,
+                                    int depth,
+                                    SplitFunc split) {
+    int node_id = node_offset + 2 * count - 2;
+    BVHNode &node = ctx.node_pool[node_id];
+    if (count == 1) {
+        node.left_node_id = node.right_node_id = -1;
+        node.primitive_offset = prim_offset;
+        node.num_primitives = 1;
+        node.box = ctx.boxes[ctx.prims[prim_offset].id];
+        return c_bvh_intersection_cost;
+    }
+
+    int mid = split_range(ctx, split, depth, prim_offset, count);
+
+    node.left_node_id = node_offset + 2 * mid - 2;
+    node.right_node_id = node_id - 1;
+    Real left_cost = construct_bvh_recursive(ctx, prim_offset, mid, node_offset, depth + 1, split);
+    Real right_cost = construct_bvh_recursive(
+        ctx, prim_offset + mid, count - mid, node_offset + 2 * mid - 1, depth + 1, split);
+    const BVHNode &left = ctx.node_pool[node.left_node_id];
+    const BVHNode &right = ctx.node_pool[node.right_node_id];
+    node.primitive_offset = -1;
+    node.num_primitives = 0;
+    node.box = merge(left.box, right.box);
+
+    Real area = surface_area(node.box);
+    Real cost_as_leaf = leaf_cost(count, ctx.leaf_block);
+    Real split_cost = c_bvh_traversal_cost + (area > 0 ?
+        (surface_area(left.box) * left_cost + surface_area(right.box) * right_cost) / area :
+        left_cost + right_cost);
+    if (count > c_bvh_max_leaf_size || split_cost < cost_as_leaf) {
+        return split_cost;
+    }
+    for (int i = node_offset; i < node_id; i++) {
+        ctx.node_pool[i].num_primitives = -1;
+    }
+    node.left_node_id = node.right_node_id = -1;
+    node.primitive_offset = prim_offset;
+    node.num_primitives = count;
+    return cost_as_leaf;
+}
+
+static int construct_bvh(const std::vector<BBox> &boxes,
+                         SplitFunc split,
+                         bool morton_order,
+                         int leaf_block,
+                         std::vector<BVHNode> &node_pool,
+                         std::vector<int> &primitive_order) {
+    primitive_order.clear();
+    if (boxes.empty()) {
+        return -1;
+    }
+    int num_prims = (int)boxes.size();
+    std::vector<BVHPrimitive> prims(num_prims);
+    parallel_for([&](int64_t i) {
+        prims[i] = {centroid(boxes[i]), int(i)};
+    }, num_prims, c_bvh_chunk_size);
+    std::vector<BVHPrimitive> scratch;
+    if (num_prims > c_bvh_task_size || morton_order) {
+        scratch.resize(num_prims);
+    }
+    int base = (int)node_pool.size();
+    node_pool.resize(base + 2 * num_prims - 1);
+    std::vector<uint32_t> morton_codes;
+    BVHBuildContext ctx{boxes, prims, scratch, node_pool, morton_codes, !morton_order, leaf_block};
+    if (morton_order) {
+        sort_morton(ctx, morton_codes);
+    }
+
+    struct BuildRange {
+        int prim_offset;
+        int count;
+        int node_offset;
+        int depth;
+    };
+    // Split the top of the tree breadth first until every range is small enough to be a task.
+    std::vector<BuildRange> ranges{{0, num_prims, base, 0}}, tasks;
+    std::vector<int> top_nodes;
+    while (!ranges.empty()) {
+        std::vector<BuildRange> next_ranges;
+        for (const BuildRange &r : ranges) {
+            if (r.count <= c_bvh_task_size) {
+                tasks.push_back(r);
+                continue;
+            }
+            int mid = split_range(ctx, split, r.depth, r.prim_offset, r.count);
+            BuildRange left{r.prim_offset, mid, r.node_offset, r.depth + 1};
+            BuildRange right{r.prim_offset + mid, r.count - mid, r.node_offset + 2 * mid - 1, r.depth + 1};
+
+            top_nodes.push_back(r.node_offset + 2 * r.count - 2);
+            BVHNode &node = node_pool[top_nodes.back()];
+            node.left_node_id = left.node_offset + 2 * left.count - 2;
+            node.right_node_id = right.node_offset + 2 * right.count - 2;
+            node.primitive_offset = -1;
+            node.num_primitives = 0;
+            next_ranges.push_back(left);
+            next_ranges.push_back(right);
+        }
+        ranges.swap(next_ranges);
+    }
+    // Largest subtrees first for better load balancing.
+    std::sort(tasks.begin(), tasks.end(), [](const BuildRange &r1, const BuildRange &r2) {
+        return r1.count > r2.count;
+    });
+    parallel_for([&](int64_t i) {
+        construct_bvh_recursive(ctx, tasks[i].prim_offset, tasks[i].count, tasks[i].node_offset, tasks[i].depth, split);
+    }, tasks.size());
+    // Children of the top nodes were all created after their parents.
+    for (auto it = top_nodes.rbegin(); it != top_nodes.rend(); it++) {
+        BVHNode &node = node_pool[*it];
+        node.box = merge(node_pool[node.left_node_id].box, node_pool[node.right_node_id].box);
+    }
+
+    // Drop the unused slots of collapsed subtrees. Children are stored before their parents,
+    // so they have already been moved when their parent is.
+    std::vector<int> remap(2 * num_prims - 1);
+    int num_nodes = base;
+    for (int i = base; i < (int)node_pool.size(); i++) {
+        BVHNode node = node_pool[i];
+        if (node.num_primitives < 0) {
+            continue;
+        }
+        if (node.num_primitives == 0) {
+            node.left_node_id = remap[node.left_node_id - base];
+            node.right_node_id = remap[node.right_node_id - base];
+        }
+        remap[i - base] = num_nodes;
+        node_pool[num_nodes++] = node;
+    }
+    node_pool.resize(num_nodes);
+
+    primitive_order.resize(num_prims);
+    parallel_for([&](int64_t i) {
+        primitive_order[i] = prims[i].id;
+    }, num_prims, c_bvh_chunk_size);
+    return remap[2 * num_prims - 2];
+}
+
+int construct_bvh(const std::vector<BBox> &boxes,
+                  std::vector<BVHNode> &node_pool,
+                  std::vector<int> &primitive_order,
+                  int leaf_block) {
+    return construct_bvh(boxes, split_median, false, leaf_block, node_pool, primitive_order);
+}
+
+int construct_bvh_sah(const std::vector<BBox> &boxes,
+                      std::vector<BVHNode> &node_pool,
+                      std::vector<int> &primitive_order,
+                      int leaf_block) {
+    return construct_bvh(boxes, split_sah, false, leaf_block, node_pool, primitive_order);
+}
+
+int construct_lbvh(const std::vector<BBox> &boxes,
+                   std::vector<BVHNode> &node_pool,
+                   std::vector<int> &primitive_order,
+                   int leaf_block) {
+    return construct_bvh(boxes, split_lbvh, true, leaf_block, node_pool, primitive_order);
+}
+
+// A primitive reference of the spatial split builder, box may be clipped to a part of the primitive.
+struct SBVHReference {
+    BBox box;
+    int id;
+};
+
+// Spatial splits are only tried where the children of the best object split overlap by more than
+// this fraction of the root area (alpha in Stich et al. 2009).
+const Real c_sbvh_min_overlap = Real(1e-5);
+// Spatial splits only shrink boxes, stop trying them deep down the tree.
+const int c_sbvh_max_spatial_depth = BVH_STACK_DEPTH / 2;
+
+struct SBVHBuildContext {
+    const SplitPrimitiveFunc &split_primitive;
+    std::vector<BVHNode> &node_pool;
+    std::vector<int> &primitive_order;
+    Real min_overlap_area;
+    int num_references;
+    int max_references;
+    int leaf_block;
+};
+
+struct SBVHSplit {
+    Real cost = infinity<Real>(); // sum of area * count of both sides
+    int axis = -1;
+    int bin = -1;
+    BBox left_box, right_box;
+    int left_count = 0, right_count = 0;
+};
+
+static SBVHSplit find_object_split(const std::vector<SBVHReference> &refs, const BBox &centroid_box) {
+    SBVHSplit best;
+    for (int axis = 0; axis < 3; axis++) {
+        Real c_min = centroid_box.p_min[axis];
+        Real extent = centroid_box.p_max[axis] - c_min;
+        if (extent <= 0) {
+            continue;
+        }
+        Real scale = BVH_SAH_BINS / extent;
+        BVHBin bins[BVH_SAH_BINS];
+        for (const SBVHReference &ref : refs) {
+            int b = std::min(int((centroid(ref.box)[axis] - c_min) * scale), BVH_SAH_BINS - 1);
+            bins[b].count++;
+            bins[b].box = merge(bins[b].box, ref.box);
+        }
+        BBox right_boxes[BVH_SAH_BINS];
+        int right_counts[BVH_SAH_BINS];
+        BBox right_box;
+        int n = 0;
+        for (int i = BVH_SAH_BINS - 1; i > 0; i--) {
+            right_box = merge(right_box, bins[i].box);
+            n += bins[i].count;
+            right_boxes[i] = right_box;
+            right_counts[i] = n;
+        }
+        BBox left_box;
+        n = 0;
+        for (int i = 0; i < BVH_SAH_BINS - 1; i++) {
+            left_box = merge(left_box, bins[i].box);
+            n += bins[i].count;
+            if (n == 0 || right_counts[i + 1] == 0) {
+                continue;
+            }
+            Real cost = n * surface_area(left_box) + right_counts[i + 1] * surface_area(right_boxes[i + 1]);
+            if (cost < best.cost) {
+                best = {cost, axis, i, left_box, right_boxes[i + 1], n, right_counts[i + 1]};
+            }
+        }
+    }
+    return best;
+}
+
+static Real spatial_split_pos(const BBox &node_box, int axis, int bin) {
+    Real extent = node_box.p_max[axis] - node_box.p_min[axis];
+    return node_box.p_min[axis] + extent * (bin + 1) / BVH_SAH_BINS;
+}
+
+// Spatial bins count the references that start and end in them,
+// the box of a bin bounds the parts of the references clipped to it.
+static SBVHSplit find_spatial_split(const SBVHBuildContext &ctx,
+                                    const std::vector<SBVHReference> &refs,
+                                    const BBox &node_box) {
+    SBVHSplit best;
+    for (int axis = 0; axis < 3; axis++) {
+        Real b_min = node_box.p_min[axis];
+        Real extent = node_box.p_max[axis] - b_min;
+        if (extent <= 0) {
+            continue;
+        }
+        Real scale = BVH_SAH_BINS / extent;
+        BBox boxes[BVH_SAH_BINS];
+        int enter[BVH_SAH_BINS] = {}, exit[BVH_SAH_BINS] = {};
+        for (const SBVHReference &ref : refs) {
+            int first = std::clamp(int((ref.box.p_min[axis] - b_min) * scale), 0, BVH_SAH_BINS - 1);
+            int last = std::clamp(int((ref.box.p_max[axis] - b_min) * scale), first, BVH_SAH_BINS - 1);
+            BBox rest = ref.box;
+            for (int i = first; i < last; i++) {
+                auto [left, right] = ctx.split_primitive(ref.id, axis, spatial_split_pos(node_box, axis, i), rest);
+                boxes[i] = merge(boxes[i], left);
+                rest = right;
+            }
+            boxes[last] = merge(boxes[last], rest);
+            enter[first]++;
+            exit[last]++;
+        }
+        BBox right_boxes[BVH_SAH_BINS];
+        int right_counts[BVH_SAH_BINS];
+        BBox right_box;
+        int n = 0;
+        for (int i = BVH_SAH_BINS - 1; i > 0; i--) {
+            right_box = merge(right_box, boxes[i]);
+            n += exit[i];
+            right_boxes[i] = right_box;
+            right_counts[i] = n;
+        }
+        BBox left_box;
+        n = 0;
+        for (int i = 0; i < BVH_SAH_BINS - 1; i++) {
+            left_box = merge(left_box, boxes[i]);
+            n += enter[i];
+            if (n == 0 || right_counts[i + 1] == 0) {
+                continue;
+            }
+            Real cost = n * surface_area(left_box) + right_counts[i + 1] * surface_area(right_boxes[i + 1]);
+            if (cost < best.cost) {
+                best = {cost, axis, i, left_box, right_boxes[i + 1], n, right_counts[i + 1]};
+            }
+        }
+    }
+    return best;
+}
+
+// Split the references at the plane, those that straddle it are either clipped into both sides
+// or moved whole into one side when that is cheaper ("reference unsplitting").
+static void perform_spatial_split(SBVHBuildContext &ctx,
+                                  const std::vector<SBVHReference> &refs,
+                                  const BBox &node_box,
+                                  const SBVHSplit &split,
+                                  std::vector<SBVHReference> &left_refs,
+                                  std::vector<SBVHReference> &right_refs) {
+    int axis = split.axis;
+    Real pos = spatial_split_pos(node_box, axis, split.bin);
+    BBox left_box = split.left_box, right_box = split.right_box;
+    int left_count = split.left_count, right_count = split.right_count;
+    for (const SBVHReference &ref : refs) {
+        if (ref.box.p_max[axis] <= pos) {
+            left_refs.push_back(ref);
+        } else if (ref.box.p_min[axis] >= pos) {
+            right_refs.push_back(ref);
+        } else {
+            Real split_cost = surface_area(left_box) * left_count + surface_area(right_box) * right_count;
+            BBox left_whole = merge(left_box, ref.box);
+            BBox right_whole = merge(right_box, ref.box);
+            Real left_cost = surface_area(left_whole) * left_count + surface_area(right_box) * (right_count - 1);
+            Real right_cost = surface_area(left_box) * (left_count - 1) + surface_area(right_whole) * right_count;
+            if (left_cost < split_cost && left_cost <= right_cost) {
+                left_refs.push_back(ref);
+                left_box = left_whole;
+                right_count--;
+            } else if (right_cost < split_cost) {
+                right_refs.push_back(ref);
+                right_box = right_whole;
+                left_count--;
+            } else {
+                auto [left, right] = ctx.split_primitive(ref.id, axis, pos, ref.box);
+                if (!empty(left)) {
+                    left_refs.push_back({left, ref.id});
+                }
+                if (!empty(right)) {
+                    right_refs.push_back({right, ref.id});
+                }
+            }
+        }
+    }
+    ctx.num_references += int(left_refs.size() + right_refs.size() - refs.size());
+}
+
+// Builds the subtree over refs, children are appended to the node pool before their parent.
+// Returns the index of the root.
+static int construct_sbvh_recursive(SBVHBuildContext &ctx, std::vector<SBVHReference> &refs, int depth) {
+    int count = (int)refs.size();
+    BBox node_box, centroid_box;
+    for (const SBVHReference &ref : refs) {
+        node_box = merge(node_box, ref.box);
+        Vector3 c = centroid(ref.box);
+        centroid_box = merge(centroid_box, BBox{c, c});
+    }
+
+    std::vector<SBVHReference> left_refs, right_refs;
+    if (count > 1 && depth >= c_bvh_max_split_depth) {
+        // Median split, see c_bvh_max_split_depth
+        int axis = largest_axis(centroid_box);
+        std::nth_element(refs.begin(), refs.begin() + count / 2, refs.end(),
+            [&](const SBVHReference &r1, const SBVHReference &r2) {
+                return centroid(r1.box)[axis] < centroid(r2.box)[axis];
+            });
+        left_refs.assign(refs.begin(), refs.begin() + count / 2);
+        right_refs.assign(refs.begin() + count / 2, refs.end());
+    }
+    SBVHSplit object_split;
+    if (count > 1 && left_refs.empty()) {
+        object_split = find_object_split(refs, centroid_box);
+    }
+    SBVHSplit spatial_split;
+    if (count > 1 && left_refs.empty() && depth < c_sbvh_max_spatial_depth &&
+            ctx.num_references + count <= ctx.max_references &&
+            (object_split.axis == -1 ||
+             surface_area(overlap(object_split.left_box, object_split.right_box)) > ctx.min_overlap_area)) {
+        spatial_split = find_spatial_split(ctx, refs, node_box);
+    }
+
+    Real area = surface_area(node_box);
+    Real best_cost = std::min(object_split.cost, spatial_split.cost);
+    Real cost_as_leaf = leaf_cost(count, ctx.leaf_block);
+    Real split_cost = c_bvh_traversal_cost + (area > 0 ? best_cost / area : Real(0)) * c_bvh_intersection_cost;
+    bool make_leaf = count == 1 || (left_refs.empty() &&
+        count <= c_bvh_max_leaf_size && (best_cost == infinity<Real>() || cost_as_leaf <= split_cost));
+    if (!make_leaf && spatial_split.cost < object_split.cost) {
+        perform_spatial_split(ctx, refs, node_box, spatial_split, left_refs, right_refs);
+        if (left_refs.empty() || right_refs.empty()) {
+            // every reference ended up on the same side, undo
+            ctx.num_references -= int(left_refs.size() + right_refs.size() - refs.size());
+            left_refs.clear();
+            right_refs.clear();
+        }
+    }
+    if (!make_leaf && left_refs.empty()) {
+        if (object_split.axis != -1) {
+            int axis = object_split.axis;
+            Real c_min = centroid_box.p_min[axis];
+            Real scale = BVH_SAH_BINS / (centroid_box.p_max[axis] - c_min);
+            for (const SBVHReference &ref : refs) {
+                int b = std::min(int((centroid(ref.box)[axis] - c_min) * scale), BVH_SAH_BINS - 1);
+                (b <= object_split.bin ? left_refs : right_refs).push_back(ref);
+            }
+        } else if (count <= c_bvh_max_leaf_size) {
+            make_leaf = true;
+        } else {
+            // Every centroid coincides, split the references in halves.
+            left_refs.assign(refs.begin(), refs.begin() + count / 2);
+            right_refs.assign(refs.begin() + count / 2, refs.end());
+        }
+    }
 
     BVHNode node;
-    node.box = big_box;
-    node.left_node_id = construct_bvh(left_boxes, node_pool);
-    node.right_node_id = construct_bvh(right_boxes, node_pool);
-    node.primitive_id = -1;
-    node_pool.push_back(node);
-    return node_pool.size() - 1;
-}
-
-// Tested on party_bgonly.xml, traverse version is faster than recursive version by around 2-3 s
-// Traverse version
-// std::optional<Intersection> bvh_intersect(const int bvh_root_id, const std::vector<BVHNode> &bvh_nodes, const std::vector<Shape> &shapes, const std::vector<TriangleMesh>& meshes, Ray ray) {
-//     int node_ptr = 0;
-//     bool is_left = true;
-//     std::optional<Intersection> intersection;
-//     intersection->t = infinity<Real>();
-//     unsigned int bvhStack[BVH_STACK_DEPTH];
-//     bvhStack[++node_ptr] = bvh_root_id;
-
-//     while(node_ptr)
-//     {
-//         BVHNode curr_node = bvh_nodes[bvhStack[node_ptr--]];
-
-//         if(!intersect(curr_node.box, ray))
-//             continue;
-        
-//         if(curr_node.primitive_id != -1)
-//         {
-//             std::optional<Intersection> temp_intersection = intersect_shape(shapes[curr_node.primitive_id], meshes, ray); 
-//             if(temp_intersection && temp_intersection->t < intersection->t){
-//                 intersection = std::move(temp_intersection);
-//                 if(is_left && intersection->t < ray.tmax) ray.tmax = intersection->t;
-//             }
-//             if(temp_intersection)
-//                 is_left = false;
-//         }
-//         else
-//         {
-//             bvhStack[++node_ptr] = curr_node.right_node_id;
-//             bvhStack[++node_ptr] = curr_node.left_node_id;
-//             is_left = true;
-//         }
-//     }
-//     return std::isfinite<Real>(intersection->t) ? intersection : std::nullopt;
-// }
-
-// Recursive version
-// std::optional<Intersection> bvh_intersect(const std::vector<BVHNode> &bvh_nodes, const std::vector<Shape> &shapes, const BVHNode &node, Ray ray) {
-std::optional<Intersection> bvh_intersect(const int bvh_root_id, const std::vector<BVHNode> &bvh_nodes, const std::vector<Shape> &shapes, const std::vector<TriangleMesh>& meshes, Ray ray) {
-    const BVHNode& node = bvh_nodes[bvh_root_id];
-    if (node.primitive_id != -1) {
-        return intersect_shape(shapes[node.primitive_id], meshes, ray); 
-    }
-    const BVHNode &left = bvh_nodes[node.left_node_id];
-    const BVHNode &right = bvh_nodes[node.right_node_id];
-    std::optional<Intersection> isect_left;
-    if (intersect(left.box, ray)) {
-        isect_left = bvh_intersect(node.left_node_id, bvh_nodes, shapes, meshes, ray);
-        if (isect_left) {
-            ray.tmax = isect_left->t;
-        }
-    }
-    if (intersect(right.box, ray)) {
-        // Since we've already set ray.tfar to the left node
-        // if we still hit something on the right, it's closer
-        // and we should return that.
-        if (auto isect_right = bvh_intersect(node.right_node_id, bvh_nodes, shapes, meshes, ray)) {
-            return isect_right;
-        }
-    }
-    return isect_left;
+    if (make_leaf) {
+        node.box = node_box;
+        node.left_node_id = node.right_node_id = -1;
+        node.primitive_offset = (int)ctx.primitive_order.size();
+        node.num_primitives = count;
+        for (const SBVHReference &ref : refs) {
+            ctx.primitive_order.push_back(ref.id);
+        }
+    } else {
+        std::vector<SBVHReference>().swap(refs);
+        node.left_node_id = construct_sbvh_recursive(ctx, left_refs, depth + 1);
+        node.right_node_id = construct_sbvh_recursive(ctx, right_refs, depth + 1);
+        node.box = merge(ctx.node_pool[node.left_node_id].box, ctx.node_pool[node.right_node_id].box);
+        node.primitive_offset = -1;
+        node.num_primitives = 0;
+    }
+    ctx.node_pool.push_back(node);
+    return (int)ctx.node_pool.size() - 1;
+}
+
+int construct_sbvh(const std::vector<BBox> &boxes,
+                   const SplitPrimitiveFunc &split_primitive,
+                   Real budget,
+                   std::vector<BVHNode> &node_pool,
+                   std::vector<int> &primitive_order,
+                   int leaf_block) {
+    primitive_order.clear();
+    if (boxes.empty()) {
+        return -1;
+    }
+    int num_prims = (int)boxes.size();
+    std::vector<SBVHReference> refs(num_prims);
+    BBox root_box;
+    for (int i = 0; i < num_prims; i++) {
+        refs[i] = {boxes[i], i};
+        root_box = merge(root_box, boxes[i]);
+    }
+    SBVHBuildContext ctx{split_primitive,
+                         node_pool,
+                         primitive_order,
+                         c_sbvh_min_overlap * surface_area(root_box),
+                         num_prims,
+                         num_prims + int(std::max(budget, Real(0)) * num_prims),
+                         leaf_block};
+    primitive_order.reserve(num_prims);
+    return construct_sbvh_recursive(ctx, refs, 0);
+}
+
+Real bvh_sah_cost(const int bvh_root_id, const std::vector<BVHNode> &bvh_nodes) {
+    if (bvh_nodes.empty()) {
+        return 0;
+    }
+    Real root_area = surface_area(bvh_nodes[bvh_root_id].box);
+    if (root_area <= 0) {
+        return c_bvh_intersection_cost;
+    }
+    // Every node is reached by a fraction area(node) / area(root) of the rays hitting the root.
+    Real cost = 0;
+    for (const BVHNode &node : bvh_nodes) {
+        Real p = surface_area(node.box) / root_area;
+        if (node.num_primitives > 0) {
+            cost += p * node.num_primitives * c_bvh_intersection_cost;
+        } else {
+            cost += p * c_bvh_traversal_cost;
+        }
+    }
+    return cost;
+}
+
+// Round away from the box so that the float bounds always contain the Real ones.
+static float round_down(Real v) {
+    float f = float(v);
+    return Real(f) > v ? std::nextafter(f, -infinity<float>()) : f;
+}
+
+static float round_up(Real v) {
+    float f = float(v);
+    return Real(f) < v ? std::nextafter(f, infinity<float>()) : f;
+}
+
+static int flatten_bvh_recursive(const std::vector<BVHNode> &bvh_nodes,
+                                 int node_id,
+                                 int depth,
+                                 int &max_depth,
+                                 std::vector<LinearBVHNode> &linear_nodes,
+                                 std::vector<int> *node_slots) {
+    max_depth = std::max(max_depth, depth);
+    const BVHNode &node = bvh_nodes[node_id];
+    int linear_id = (int)linear_nodes.size();
+    linear_nodes.emplace_back();
+    if (node_slots) {
+        node_slots->push_back(node_id);
+    }
+    LinearBVHNode linear_node;
+    for (int i = 0; i < 3; i++) {
+        linear_node.p_min[i] = round_down(node.box.p_min[i]);
+        linear_node.p_max[i] = round_up(node.box.p_max[i]);
+    }
+    linear_node.axis = 0;
+    if (node.num_primitives > 0) {
+        linear_node.primitive_offset = node.primitive_offset;
+        linear_node.num_primitives = uint16_t(node.num_primitives);
+    } else {
+        // The builders do not record the split axis, use the axis that separates the children the most
+        // and store the lower child first so that traversal can pick the near child from the ray direction.
+        int first = node.left_node_id;
+        int second = node.right_node_id;
+        Vector3 diff = centroid(bvh_nodes[second].box) - centroid(bvh_nodes[first].box);
+        for (int i = 1; i < 3; i++) {
+            if (fabs(diff[i]) > fabs(diff[linear_node.axis])) {
+                linear_node.axis = i;
+            }
+        }
+        if (diff[linear_node.axis] < 0) {
+            std::swap(first, second);
+        }
+        linear_node.num_primitives = 0;
+        flatten_bvh_recursive(bvh_nodes, first, depth + 1, max_depth, linear_nodes, node_slots);
+        linear_node.second_child_offset =
+            flatten_bvh_recursive(bvh_nodes, second, depth + 1, max_depth, linear_nodes, node_slots);
+    }
+    linear_nodes[linear_id] = linear_node;
+    return linear_id;
+}
+
+void flatten_bvh(const int bvh_root_id,
+                 const std::vector<BVHNode> &bvh_nodes,
+                 std::vector<LinearBVHNode> &linear_nodes,
+                 std::vector<int> *node_slots) {
+    linear_nodes.clear();
+    if (node_slots) {
+        node_slots->clear();
+    }
+    if (bvh_nodes.empty()) {
+        return;
+    }
+    linear_nodes.reserve(bvh_nodes.size());
+    int max_depth = 0;
+    flatten_bvh_recursive(bvh_nodes, bvh_root_id, 0, max_depth, linear_nodes, node_slots);
+    if (max_depth >= BVH_STACK_DEPTH) {
+        Error("BVH is too deep for the traversal stack.");
+    }
+}
+
+// Slab test against the precomputed inverse direction (pbrt-v3 3.1.2).
+// dir_is_neg selects the near and far planes so no min/max is needed.
+inline bool intersect(const LinearBVHNode &node,
+                      const Ray &r,
+                      const Vector3 &inv_dir,
+                      const int dir_is_neg[3]) {
+    const Vector3f *bounds = &node.p_min;
+    Real t_min = (bounds[dir_is_neg[0]].x - r.origin.x) * inv_dir.x;
+    Real t_max = (bounds[1 - dir_is_neg[0]].x - r.origin.x) * inv_dir.x;
+    Real ty_min = (bounds[dir_is_neg[1]].y - r.origin.y) * inv_dir.y;
+    Real ty_max = (bounds[1 - dir_is_neg[1]].y - r.origin.y) * inv_dir.y;
+    if (t_min > ty_max || ty_min > t_max) {
+        return false;
+    }
+    if (ty_min > t_min) t_min = ty_min;
+    if (ty_max < t_max) t_max = ty_max;
+    Real tz_min = (bounds[dir_is_neg[2]].z - r.origin.z) * inv_dir.z;
+    Real tz_max = (bounds[1 - dir_is_neg[2]].z - r.origin.z) * inv_dir.z;
+    if (t_min > tz_max || tz_min > t_max) {
+        return false;
+    }
+    if (tz_min > t_min) t_min = tz_min;
+    if (tz_max < t_max) t_max = tz_max;
+    return t_min <= r.tmax && t_max >= r.tmin;
+}
+
+// Walk the tree and call on_leaf(primitive_offset, num_primitives, ray) for every leaf the ray reaches,
+// the leaf holding the primitives at positions [primitive_offset, primitive_offset + num_primitives) of the leaf order.
+// on_leaf may shorten ray.tmax to cull farther nodes, and returns true to end the traversal.
+template <typename LeafFunc>
+static void bvh_traverse_leaves(const std::vector<LinearBVHNode> &bvh_nodes, Ray &ray, LeafFunc on_leaf) {
+    if (bvh_nodes.empty()) {
+        return;
+    }
+    Vector3 inv_dir = Vector3{Real(1) / ray.dir.x, Real(1) / ray.dir.y, Real(1) / ray.dir.z};
+    int dir_is_neg[3] = {inv_dir.x < 0, inv_dir.y < 0, inv_dir.z < 0};
+    int to_visit[BVH_STACK_DEPTH];
+    int to_visit_offset = 0;
+    int current_node_id = 0;
+    while (true) {
+        const LinearBVHNode &node = bvh_nodes[current_node_id];
+        if (intersect(node, ray, inv_dir, dir_is_neg)) {
+            if (node.num_primitives > 0) {
+                if (on_leaf(node.primitive_offset, node.num_primitives, ray)) {
+                    return;
+                }
+                if (to_visit_offset == 0) break;
+                current_node_id = to_visit[--to_visit_offset];
+            } else if (dir_is_neg[node.axis]) {
+                // Visit the second (upper) child first
+                to_visit[to_visit_offset++] = current_node_id + 1;
+                current_node_id = node.second_child_offset;
+            } else {
+                to_visit[to_visit_offset++] = node.second_child_offset;
+                current_node_id = current_node_id + 1;
+            }
+        } else {
+            if (to_visit_offset == 0) break;
+            current_node_id = to_visit[--to_visit_offset];
+        }
+    }
+}
+
+template <template <int> class WideNode, int N, typename LeafFunc>
+static void bvh_traverse_leaves(const std::vector<WideNode<N>> &bvh_nodes, Ray &ray, LeafFunc on_leaf);
+
+// Same walk calling on_primitive(primitive_id, ray) for every primitive of the leaves reached,
+// primitive_id being the primitive's position in leaf order.
+template <typename Nodes, typename PrimitiveFunc>
+static void bvh_traverse(const Nodes &bvh_nodes, Ray &ray, PrimitiveFunc on_primitive) {
+    bvh_traverse_leaves(bvh_nodes, ray, [&](int primitive_offset, int num_primitives, Ray &r) {
+        for (int i = 0; i < num_primitives; i++) {
+            if (on_primitive(primitive_offset + i, r)) {
+                return true;
+            }
+        }
+        return false;
+    });
+}
+
+std::optional<ShapeHit> bvh_intersect(const std::vector<LinearBVHNode> &bvh_nodes, const std::vector<Shape> &shapes, const std::vector<TriangleMesh>& meshes, Ray ray) {
+    ShapeHit hit{infinity<Real>(), Vector2{0, 0}, -1, -1};
+    bvh_traverse(bvh_nodes, ray, [&](int primitive_id, Ray &r) {
+        if (intersect_shape(shapes[primitive_id], meshes, r, hit)) {
+            // Later hits have to be closer than this one
+            r.tmax = hit.t;
+            hit.shape_id = primitive_id;
+        }
+        return false;
+    });
+    if (hit.shape_id == -1) {
+        return {};
+    }
+    return hit;
+}
+
+bool bvh_occluded(const std::vector<LinearBVHNode> &bvh_nodes, const std::vector<Shape> &shapes, const std::vector<TriangleMesh>& meshes, Ray ray) {
+    bool occluded = false;
+    bvh_traverse(bvh_nodes, ray, [&](int primitive_id, Ray &r) {
+        occluded = occluded_shape(shapes[primitive_id], meshes, r);
+        return occluded;
+    });
+    return occluded;
+}
+
+template <int N>
+static int collapse_bvh_recursive(const std::vector<BVHNode> &bvh_nodes,
+                                  int node_id,
+                                  int depth,
+                                  int &max_depth,
+                                  std::vector<WideBVHNode<N>> &wide_nodes,
+                                  std::vector<int> *node_slots) {
+    max_depth = std::max(max_depth, depth);
+    const BVHNode &node = bvh_nodes[node_id];
+    int children[N];
+    int num_children = 0;
+    if (node.num_primitives > 0) {
+        // the root is a leaf
+        children[num_children++] = node_id;
+    } else {
+        children[num_children++] = node.left_node_id;
+        children[num_children++] = node.right_node_id;
+    }
+    // Open the interior child with the largest surface area until the node is full.
+    while (num_children < N) {
+        int best = -1;
+        Real best_area = -1;
+        for (int i = 0; i < num_children; i++) {
+            const BVHNode &child = bvh_nodes[children[i]];
+            if (child.num_primitives == 0 && surface_area(child.box) > best_area) {
+                best = i;
+                best_area = surface_area(child.box);
+            }
+        }
+        if (best == -1) {
+            break;
+        }
+        const BVHNode &child = bvh_nodes[children[best]];
+        children[best] = child.left_node_id;
+        children[num_children++] = child.right_node_id;
+    }
+
+    int wide_id = (int)wide_nodes.size();
+    wide_nodes.emplace_back();
+    if (node_slots) {
+        node_slots->resize(wide_nodes.size() * N, -1);
+    }
+    WideBVHNode<N> wide_node;
+    for (int i = 0; i < N; i++) {
+        for (int axis = 0; axis < 3; axis++) {
+            // empty slots get an inverted box that no ray can hit
+            wide_node.bounds[0][axis][i] = infinity<float>();
+            wide_node.bounds[1][axis][i] = -infinity<float>();
+        }
+        wide_node.children[i] = c_wide_bvh_empty;
+    }
+    for (int i = 0; i < num_children; i++) {
+        const BVHNode &child = bvh_nodes[children[i]];
+        for (int axis = 0; axis < 3; axis++) {
+            wide_node.bounds[0][axis][i] = round_down(child.box.p_min[axis]);
+            wide_node.bounds[1][axis][i] = round_up(child.box.p_max[axis]);
+        }
+        if (node_slots) {
+            (*node_slots)[wide_id * N + i] = children[i];
+        }
+        if (child.num_primitives > 0) {
+            wide_node.children[i] = wide_bvh_leaf(child.primitive_offset, child.num_primitives);
+        } else {
+            wide_node.children[i] =
+                collapse_bvh_recursive<N>(bvh_nodes, children[i], depth + 1, max_depth, wide_nodes, node_slots);
+        }
+    }
+    wide_nodes[wide_id] = wide_node;
+    return wide_id;
+}
+
+template <int N>
+void collapse_bvh(const int bvh_root_id,
+                  const std::vector<BVHNode> &bvh_nodes,
+                  std::vector<WideBVHNode<N>> &wide_nodes,
+                  std::vector<int> *node_slots) {
+    wide_nodes.clear();
+    if (node_slots) {
+        node_slots->clear();
+    }
+    if (bvh_nodes.empty()) {
+        return;
+    }
+    int max_depth = 0;
+    collapse_bvh_recursive<N>(bvh_nodes, bvh_root_id, 0, max_depth, wide_nodes, node_slots);
+    if (max_depth >= BVH_STACK_DEPTH) {
+        Error("BVH is too deep for the traversal stack.");
+    }
+}
+
+// Half the surface area of child i, enough to compare how likely children are to be visited.
+template <int N>
+static float child_area(const WideBVHNode<N> &node, int i) {
+    float dx = node.bounds[1][0][i] - node.bounds[0][0][i];
+    float dy = node.bounds[1][1][i] - node.bounds[0][1][i];
+    float dz = node.bounds[1][2][i] - node.bounds[0][2][i];
+    return dx * dy + dy * dz + dz * dx;
+}
+
+// Renumber the wide nodes so that the nodes most likely visited after a node are stored close to it.
+// Treelets of up to treelet_size nodes are grown from a root by adding the child with the largest surface area
+// (Aila and Karras 2010) and stored contiguously, depth-first with the larger children first so that
+// a node is usually followed by its most likely child. The children left out start new treelets,
+// laid out depth-first after their parent treelet. The topology does not change, the root stays at 0.
+template <int N>
+static void reorder_bvh_treelets(std::vector<WideBVHNode<N>> &wide_nodes, std::vector<int> &node_slots,
+                                 int treelet_size) {
+    if (wide_nodes.empty()) {
+        return;
+    }
+    auto sorted_children = [&](int node_id, std::pair<float, int> children[N]) {
+        const WideBVHNode<N> &node = wide_nodes[node_id];
+        int num_children = 0;
+        for (int i = 0; i < N; i++) {
+            if (node.children[i] >= 0) {
+                children[num_children++] = {child_area(node, i), node.children[i]};
+            }
+        }
+        std::sort(children, children + num_children, std::greater<>());
+        return num_children;
+    };
+    std::vector<int> order;
+    order.reserve(wide_nodes.size());
+    std::vector<int> treelet_id(wide_nodes.size(), -1);
+    std::vector<int> treelet_roots{0};
+    // (surface area, node) of the candidates of the treelet being grown
+    std::vector<std::pair<float, int>> candidates;
+    std::vector<int> stack;
+    std::pair<float, int> children[N];
+    for (int treelet = 0; !treelet_roots.empty(); treelet++) {
+        int root = treelet_roots.back();
+        treelet_roots.pop_back();
+        candidates.clear();
+        candidates.emplace_back(infinity<float>(), root);
+        for (int num_nodes = 0; !candidates.empty() && num_nodes < treelet_size; num_nodes++) {
+            std::pop_heap(candidates.begin(), candidates.end());
+            int node_id = candidates.back().second;
+            candidates.pop_back();
+            treelet_id[node_id] = treelet;
+            int num_children = sorted_children(node_id, children);
+            for (int i = 0; i < num_children; i++) {
+                candidates.push_back(children[i]);
+                std::push_heap(candidates.begin(), candidates.end());
+            }
+        }
+        stack.push_back(root);
+        while (!stack.empty()) {
+            int node_id = stack.back();
+            stack.pop_back();
+            order.push_back(node_id);
+            int num_children = sorted_children(node_id, children);
+            for (int i = num_children - 1; i >= 0; i--) {
+                if (treelet_id[children[i].second] == treelet) {
+                    stack.push_back(children[i].second);
+                }
+            }
+        }
+        // Push the least likely first so that the largest remaining subtree follows this treelet.
+        std::sort(candidates.begin(), candidates.end());
+        for (const auto &candidate : candidates) {
+            treelet_roots.push_back(candidate.second);
+        }
+    }
+
+    std::vector<int> new_id(wide_nodes.size());
+    for (int i = 0; i < (int)order.size(); i++) {
+        new_id[order[i]] = i;
+    }
+    std::vector<WideBVHNode<N>> reordered(wide_nodes.size());
+    std::vector<int> reordered_slots(node_slots.size());
+    for (int i = 0; i < (int)order.size(); i++) {
+        WideBVHNode<N> node = wide_nodes[order[i]];
+        for (int j = 0; j < N; j++) {
+            if (node.children[j] >= 0) {
+                node.children[j] = new_id[node.children[j]];
+            }
+            reordered_slots[i * N + j] = node_slots[order[i] * N + j];
+        }
+        reordered[i] = node;
+    }
+    wide_nodes.swap(reordered);
+    node_slots.swap(reordered_slots);
+}
+
+// Ray data shared by the SIMD box tests.
+struct WideBVHRay {
+    float org[3];
+    float inv_dir[3];
+    int dir_is_neg[3];
+    float t_min;
+    float t_max;
+};
+
+// Float error bound of the slab test (pbrt-v3 3.9.1), applied to the exit distance
+// so that rounding can never make a ray miss a box it touches.
+static const float c_slab_far_scale = 1 + 2 * (3 * std::numeric_limits<float>::epsilon() * 0.5f) /
+                                             (1 - 3 * std::numeric_limits<float>::epsilon() * 0.5f);
+
+// Test the ray against all children of the node at once.
+// Returns a bit mask of the children hit and writes their entry distances to t_near.
+// The ray's t interval is the second operand of every min/max, so the NaN from 0 * inf
+// in an axis-parallel slab falls back to it.
+#if defined(TAKE_SSE)
+static int intersect_children(const float near_x[4], const float near_y[4], const float near_z[4],
+                              const float far_x[4], const float far_y[4], const float far_z[4],
+                              const WideBVHRay &r,
+                              float t_near[4]) {
+    __m128 t0 = _mm_set1_ps(r.t_min);
+    __m128 t1 = _mm_set1_ps(r.t_max);
+    __m128 ox = _mm_set1_ps(r.org[0]), oy = _mm_set1_ps(r.org[1]), oz = _mm_set1_ps(r.org[2]);
+    __m128 ix = _mm_set1_ps(r.inv_dir[0]), iy = _mm_set1_ps(r.inv_dir[1]), iz = _mm_set1_ps(r.inv_dir[2]);
+    t0 = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(near_x), ox), ix), t0);
+    t0 = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(near_y), oy), iy), t0);
+    t0 = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(near_z), oz), iz), t0);
+    __m128 far_t = _mm_set1_ps(infinity<float>());
+    far_t = _mm_min_ps(_mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(far_x), ox), ix), far_t);
+    far_t = _mm_min_ps(_mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(far_y), oy), iy), far_t);
+    far_t = _mm_min_ps(_mm_mul_ps(_mm_sub_ps(_mm_loadu_ps(far_z), oz), iz), far_t);
+    t1 = _mm_min_ps(_mm_mul_ps(far_t, _mm_set1_ps(c_slab_far_scale)), t1);
+    _mm_storeu_ps(t_near, t0);
+    return _mm_movemask_ps(_mm_cmple_ps(t0, t1));
+}
+#endif
+
+template <int N>
+static int intersect_children(const WideBVHNode<N> &node, const WideBVHRay &r, float t_near[N]) {
+    const float *near_x = node.bounds[r.dir_is_neg[0]][0];
+    const float *near_y = node.bounds[r.dir_is_neg[1]][1];
+    const float *near_z = node.bounds[r.dir_is_neg[2]][2];
+    const float *far_x = node.bounds[1 - r.dir_is_neg[0]][0];
+    const float *far_y = node.bounds[1 - r.dir_is_neg[1]][1];
+    const float *far_z = node.bounds[1 - r.dir_is_neg[2]][2];
+#if defined(TAKE_AVX)
+    if constexpr (N == 8) {
+        __m256 t0 = _mm256_set1_ps(r.t_min);
+        __m256 t1 = _mm256_set1_ps(r.t_max);
+        __m256 ox = _mm256_set1_ps(r.org[0]), oy = _mm256_set1_ps(r.org[1]), oz = _mm256_set1_ps(r.org[2]);
+        __m256 ix = _mm256_set1_ps(r.inv_dir[0]), iy = _mm256_set1_ps(r.inv_dir[1]), iz = _mm256_set1_ps(r.inv_dir[2]);
+        t0 = _mm256_max_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(near_x), ox), ix), t0);
+        t0 = _mm256_max_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(near_y), oy), iy), t0);
+        t0 = _mm256_max_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(near_z), oz), iz), t0);
+        __m256 far_t = _mm256_set1_ps(infinity<float>());
+        far_t = _mm256_min_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(far_x), ox), ix), far_t);
+        far_t = _mm256_min_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(far_y), oy), iy), far_t);
+        far_t = _mm256_min_ps(_mm256_mul_ps(_mm256_sub_ps(_mm256_loadu_ps(far_z), oz), iz), far_t);
+        t1 = _mm256_min_ps(_mm256_mul_ps(far_t, _mm256_set1_ps(c_slab_far_scale)), t1);
+        _mm256_storeu_ps(t_near, t0);
+        return _mm256_movemask_ps(_mm256_cmp_ps(t0, t1, _CMP_LE_OQ));
+    }
+#endif
+#if defined(TAKE_SSE)
+    // 4 children per SSE test, two of them for BVH8 without AVX
+    int mask = 0;
+    for (int i = 0; i < N; i += 4) {
+        mask |= intersect_children(near_x + i, near_y + i, near_z + i,
+                                   far_x + i, far_y + i, far_z + i, r, t_near + i) << i;
+    }
+    return mask;
+#else
+    int mask = 0;
+    for (int i = 0; i < N; i++) {
+        float t0 = r.t_min, t1 = infinity<float>();
+        for (int axis = 0; axis < 3; axis++) {
+            const float *near_a = node.bounds[r.dir_is_neg[axis]][axis];
+            const float *far_a = node.bounds[1 - r.dir_is_neg[axis]][axis];
+            float t_enter = (near_a[i] - r.org[axis]) * r.inv_dir[axis];
+            float t_exit = (far_a[i] - r.org[axis]) * r.inv_dir[axis];
+            t0 = t_enter > t0 ? t_enter : t0;
+            t1 = t_exit < t1 ? t_exit : t1;
+        }
+        t1 = std::min(t1 * c_slab_far_scale, r.t_max);
+        t_near[i] = t0;
+        mask |= int(t0 <= t1) << i;
+    }
+    return mask;
+#endif
+}
+
+// Quantized nodes are decoded to float bounds and tested like a WideBVHNode.
+// The decode has to be computed exactly like this by quantize_bvh_node for the bounds to stay conservative:
+// q * 2^exponent is exact, so only the addition rounds.
+static float dequantize(float origin, int q, float scale) {
+    return origin + float(q) * scale;
+}
+
+// 2^exponent for the normal range [-126, 127] the exponents are kept in, without a call to ldexp.
+static float quantized_scale(int exponent) {
+    uint32_t bits = uint32_t(exponent + 127) << 23;
+    float scale;
+    std::memcpy(&scale, &bits, sizeof(float));
+    return scale;
+}
+
+template <int N>
+static const float (&child_bounds(const WideBVHNode<N> &node, WideBVHNode<N> &))[2][3][N] {
+    return node.bounds;
+}
+
+template <int N>
+static const float (&child_bounds(const QuantizedBVHNode<N> &node, WideBVHNode<N> &decoded))[2][3][N] {
+    for (int axis = 0; axis < 3; axis++) {
+        float scale = quantized_scale(node.exponent[axis]);
+#if defined(TAKE_SSE) && defined(__SSE4_1__)
+        __m128 origin = _mm_set1_ps(node.origin[axis]);
+        __m128 scale4 = _mm_set1_ps(scale);
+        for (int side = 0; side < 2; side++) {
+            for (int i = 0; i < N; i += 4) {
+                int32_t q4;
+                std::memcpy(&q4, &node.q[side][axis][i], sizeof(q4));
+                __m128 q = _mm_cvtepi32_ps(_mm_cvtepu8_epi32(_mm_cvtsi32_si128(q4)));
+                _mm_storeu_ps(&decoded.bounds[side][axis][i], _mm_add_ps(origin, _mm_mul_ps(q, scale4)));
+            }
+        }
+#else
+        for (int i = 0; i < N; i++) {
+            decoded.bounds[0][axis][i] = dequantize(node.origin[axis], node.q[0][axis][i], scale);
+            decoded.bounds[1][axis][i] = dequantize(node.origin[axis], node.q[1][axis][i], scale);
+        }
+#endif
+    }
+    return decoded.bounds;
+}
+
+template <int N>
+static int intersect_children(const QuantizedBVHNode<N> &node, const WideBVHRay &r, float t_near[N]) {
+    WideBVHNode<N> decoded;
+    child_bounds(node, decoded);
+    return intersect_children(decoded, r, t_near) & ((1 << node.num_children) - 1);
+}
+
+template <int N>
+static QuantizedBVHNode<N> quantize_bvh_node(const WideBVHNode<N> &node) {
+    QuantizedBVHNode<N> quantized;
+    int num_children = 0;
+    while (num_children < N && node.children[num_children] != c_wide_bvh_empty) {
+        num_children++;
+    }
+    quantized.num_children = uint8_t(num_children);
+    for (int axis = 0; axis < 3; axis++) {
+        float lo = infinity<float>(), hi = -infinity<float>();
+        for (int i = 0; i < num_children; i++) {
+            lo = std::min(lo, node.bounds[0][axis][i]);
+            hi = std::max(hi, node.bounds[1][axis][i]);
+        }
+        // Smallest power of two grid whose 255 steps from lo reach hi
+        int exponent = -126;
+        if (hi > lo) {
+            exponent = std::max(exponent, int(std::ceil(std::log2((double(hi) - lo) / 255))));
+        }
+        while (dequantize(lo, 255, quantized_scale(exponent)) < hi) {
+            exponent++;
+        }
+        float scale = quantized_scale(exponent);
+        quantized.origin[axis] = lo;
+        quantized.exponent[axis] = int8_t(exponent);
+        for (int i = 0; i < N; i++) {
+            if (i >= num_children) {
+                quantized.q[0][axis][i] = quantized.q[1][axis][i] = 0;
+                continue;
+            }
+            float child_lo = node.bounds[0][axis][i], child_hi = node.bounds[1][axis][i];
+            int q_lo = std::clamp(int(std::floor((double(child_lo) - lo) / scale)), 0, 255);
+            while (q_lo > 0 && dequantize(lo, q_lo, scale) > child_lo) {
+                q_lo--;
+            }
+            int q_hi = std::clamp(int(std::ceil((double(child_hi) - lo) / scale)), 0, 255);
+            while (q_hi < 255 && dequantize(lo, q_hi, scale) < child_hi) {
+                q_hi++;
+            }
+            quantized.q[0][axis][i] = uint8_t(q_lo);
+            quantized.q[1][axis][i] = uint8_t(q_hi);
+        }
+    }
+    for (int i = 0; i < N; i++) {
+        quantized.children[i] = node.children[i];
+    }
+    return quantized;
+}
+
+template <int N>
+void quantize_bvh(const std::vector<WideBVHNode<N>> &wide_nodes, std::vector<QuantizedBVHNode<N>> &quantized_nodes) {
+    quantized_nodes.resize(wide_nodes.size());
+    parallel_for([&](int64_t i) {
+        quantized_nodes[i] = quantize_bvh_node(wide_nodes[i]);
+    }, wide_nodes.size(), c_bvh_chunk_size);
+}
+
+// Wide traversal, for both WideBVHNode and QuantizedBVHNode.
+template <template <int> class WideNode, int N, typename LeafFunc>
+static void bvh_traverse_leaves(const std::vector<WideNode<N>> &bvh_nodes, Ray &ray, LeafFunc on_leaf) {
+    if (bvh_nodes.empty()) {
+        return;
+    }
+    WideBVHRay wide_ray;
+    for (int axis = 0; axis < 3; axis++) {
+        wide_ray.org[axis] = float(ray.origin[axis]);
+        wide_ray.inv_dir[axis] = float(Real(1) / ray.dir[axis]);
+        wide_ray.dir_is_neg[axis] = wide_ray.inv_dir[axis] < 0;
+    }
+    wide_ray.t_min = round_down(ray.tmin);
+    wide_ray.t_max = round_up(ray.tmax);
+
+    struct StackEntry {
+        int node_id;
+        float t_near;
+    };
+    // every node pushes at most N - 1 siblings on top of the path to it
+    StackEntry stack[BVH_STACK_DEPTH * (N - 1) + 1];
+    int stack_size = 0;
+    stack[stack_size++] = {0, wide_ray.t_min};
+    while (stack_size > 0) {
+        StackEntry entry = stack[--stack_size];
+        if (entry.t_near > wide_ray.t_max) {
+            // a closer hit was found after this node was pushed
+            continue;
+        }
+        const WideNode<N> &node = bvh_nodes[entry.node_id];
+        float t_near[N];
+        int mask = intersect_children(node, wide_ray, t_near);
+        StackEntry hits[N];
+        int num_hits = 0;
+        for (int i = 0; i < N; i++) {
+            if (!(mask & (1 << i))) {
+                continue;
+            }
+            int child = node.children[i];
+            if (is_wide_bvh_leaf(child)) {
+                if (on_leaf(wide_bvh_primitive_offset(child), wide_bvh_num_primitives(child), ray)) {
+                    return;
+                }
+                wide_ray.t_max = round_up(ray.tmax);
+            } else {
+                // insertion sort so that the nearest child ends up on top of the stack
+                int j = num_hits++;
+                for (; j > 0 && hits[j - 1].t_near < t_near[i]; j--) {
+                    hits[j] = hits[j - 1];
+                }
+                hits[j] = {child, t_near[i]};
+            }
+        }
+        for (int i = 0; i < num_hits; i++) {
+            stack[stack_size++] = hits[i];
+        }
+    }
+}
+
+template <typename Nodes>
+static std::optional<ShapeHit> bvh_intersect_shapes(const Nodes &bvh_nodes,
+                                                    const std::vector<Shape> &shapes,
+                                                    const std::vector<TriangleMesh>& meshes,
+                                                    Ray ray) {
+    ShapeHit hit{infinity<Real>(), Vector2{0, 0}, -1, -1};
+    bvh_traverse(bvh_nodes, ray, [&](int primitive_id, Ray &r) {
+        if (intersect_shape(shapes[primitive_id], meshes, r, hit)) {
+            r.tmax = hit.t;
+            hit.shape_id = primitive_id;
+        }
+        return false;
+    });
+    if (hit.shape_id == -1) {
+        return {};
+    }
+    return hit;
+}
+
+template <typename Nodes>
+static bool bvh_occluded_shapes(const Nodes &bvh_nodes,
+                                const std::vector<Shape> &shapes,
+                                const std::vector<TriangleMesh>& meshes,
+                                Ray ray) {
+    bool occluded = false;
+    bvh_traverse(bvh_nodes, ray, [&](int primitive_id, Ray &r) {
+        occluded = occluded_shape(shapes[primitive_id], meshes, r);
+        return occluded;
+    });
+    return occluded;
+}
+
+template <int N>
+std::optional<ShapeHit> bvh_intersect(const std::vector<WideBVHNode<N>> &bvh_nodes,
+                                      const std::vector<Shape> &shapes,
+                                      const std::vector<TriangleMesh>& meshes,
+                                      Ray ray) {
+    return bvh_intersect_shapes(bvh_nodes, shapes, meshes, ray);
+}
+
+template <int N>
+bool bvh_occluded(const std::vector<WideBVHNode<N>> &bvh_nodes,
+                  const std::vector<Shape> &shapes,
+                  const std::vector<TriangleMesh>& meshes,
+                  Ray ray) {
+    return bvh_occluded_shapes(bvh_nodes, shapes, meshes, ray);
+}
+
+template <int N>
+std::optional<ShapeHit> bvh_intersect(const std::vector<QuantizedBVHNode<N>> &bvh_nodes,
+                                      const std::vector<Shape> &shapes,
+                                      const std::vector<TriangleMesh>& meshes,
+                                      Ray ray) {
+    return bvh_intersect_shapes(bvh_nodes, shapes, meshes, ray);
+}
+
+template <int N>
+bool bvh_occluded(const std::vector<QuantizedBVHNode<N>> &bvh_nodes,
+                  const std::vector<Shape> &shapes,
+                  const std::vector<TriangleMesh>& meshes,
+                  Ray ray) {
+    return bvh_occluded_shapes(bvh_nodes, shapes, meshes, ray);
+}
+
+template void collapse_bvh<4>(const int, const std::vector<BVHNode> &, std::vector<BVH4Node> &, std::vector<int> *);
+template void collapse_bvh<8>(const int, const std::vector<BVHNode> &, std::vector<BVH8Node> &, std::vector<int> *);
+template std::optional<ShapeHit> bvh_intersect<4>(const std::vector<BVH4Node> &, const std::vector<Shape> &, const std::vector<TriangleMesh> &, Ray);
+template std::optional<ShapeHit> bvh_intersect<8>(const std::vector<BVH8Node> &, const std::vector<Shape> &, const std::vector<TriangleMesh> &, Ray);
+template bool bvh_occluded<4>(const std::vector<BVH4Node> &, const std::vector<Shape> &, const std::vector<TriangleMesh> &, Ray);
+template bool bvh_occluded<8>(const std::vector<BVH8Node> &, const std::vector<Shape> &, const std::vector<TriangleMesh> &, Ray);
+template void quantize_bvh<4>(const std::vector<BVH4Node> &, std::vector<QBVH4Node> &);
+template void quantize_bvh<8>(const std::vector<BVH8Node> &, std::vector<QBVH8Node> &);
+template std::optional<ShapeHit> bvh_intersect<4>(const std::vector<QBVH4Node> &, const std::vector<Shape> &, const std::vector<TriangleMesh> &, Ray);
+template std::optional<ShapeHit> bvh_intersect<8>(const std::vector<QBVH8Node> &, const std::vector<Shape> &, const std::vector<TriangleMesh> &, Ray);
+template bool bvh_occluded<4>(const std::vector<QBVH4Node> &, const std::vector<Shape> &, const std::vector<TriangleMesh> &, Ray);
+template bool bvh_occluded<8>(const std::vector<QBVH8Node> &, const std::vector<Shape> &, const std::vector<TriangleMesh> &, Ray);
+
+
+// Ray sheared onto the +z axis for the watertight triangle test (Woop et al. 2013),
+// kz being the largest component of the direction.
+struct WatertightRay {
+    Vector3f origin;
+    int kx, ky, kz;
+    float sx, sy, sz;
+};
+
+static WatertightRay make_watertight_ray(const Ray &ray) {
+    WatertightRay r;
+    r.origin = Vector3f(ray.origin);
+    Vector3 abs_dir{std::fabs(ray.dir.x), std::fabs(ray.dir.y), std::fabs(ray.dir.z)};
+    r.kz = abs_dir.x > abs_dir.y ? (abs_dir.x > abs_dir.z ? 0 : 2) : (abs_dir.y > abs_dir.z ? 1 : 2);
+    r.kx = (r.kz + 1) % 3;
+    r.ky = (r.kx + 1) % 3;
+    // Keep the winding so that the sign of the edge functions does not depend on the ray
+    if (ray.dir[r.kz] < 0) {
+        std::swap(r.kx, r.ky);
+    }
+    r.sx = float(ray.dir[r.kx] / ray.dir[r.kz]);
+    r.sy = float(ray.dir[r.ky] / ray.dir[r.kz]);
+    r.sz = float(Real(1) / ray.dir[r.kz]);
+    return r;
+}
+
+static float max_abs(const Vector3f &v) {
+    return std::max(std::fabs(v.x), std::max(std::fabs(v.y), std::fabs(v.z)));
+}
+
+static constexpr float float_gamma(int n) {
+    return n * (std::numeric_limits<float>::epsilon() * 0.5f) / (1 - n * (std::numeric_limits<float>::epsilon() * 0.5f));
+}
+
+// Edges shared by two triangles are evaluated identically, so rays cannot slip between them.
+// Hits closer than the rounding error of t (pbrt-v3 3.9) are rejected, which keeps rays leaving a surface
+// from hitting it again. Shadow rays end on a surface as well, with within_tmax hits that close to tmax
+// are rejected too. Writes t and the barycentrics of p1 and p2 only on a hit.
+static bool intersect_packed_triangle(const PackedTriangle &tri, const WatertightRay &r, const Ray &ray,
+                                      bool within_tmax, Real &t, Vector2 &uv) {
+    Vector3f a = tri.p0 - r.origin, b = tri.p1 - r.origin, c = tri.p2 - r.origin;
+    float ax = a[r.kx] - r.sx * a[r.kz], ay = a[r.ky] - r.sy * a[r.kz];
+    float bx = b[r.kx] - r.sx * b[r.kz], by = b[r.ky] - r.sy * b[r.kz];
+    float cx = c[r.kx] - r.sx * c[r.kz], cy = c[r.ky] - r.sy * c[r.kz];
+    float e0 = bx * cy - by * cx;
+    float e1 = cx * ay - cy * ax;
+    float e2 = ax * by - ay * bx;
+    if (e0 == 0 || e1 == 0 || e2 == 0) {
+        // The ray passes (nearly) through an edge, redo the edge functions in double to get the sign right
+        e0 = float(double(bx) * cy - double(by) * cx);
+        e1 = float(double(cx) * ay - double(cy) * ax);
+        e2 = float(double(ax) * by - double(ay) * bx);
+    }
+    if ((e0 < 0 || e1 < 0 || e2 < 0) && (e0 > 0 || e1 > 0 || e2 > 0)) {
+        return false;
+    }
+    float det = e0 + e1 + e2;
+    if (det == 0) {
+        return false;
+    }
+    float az = r.sz * a[r.kz], bz = r.sz * b[r.kz], cz = r.sz * c[r.kz];
+    float inv_det = 1 / det;
+    float t_hit = (e0 * az + e1 * bz + e2 * cz) * inv_det;
+    if (t_hit < ray.tmin || ray.tmax < t_hit) {
+        return false;
+    }
+    float max_xt = std::max(std::fabs(ax), std::max(std::fabs(bx), std::fabs(cx)));
+    float max_yt = std::max(std::fabs(ay), std::max(std::fabs(by), std::fabs(cy)));
+    float max_zt = std::max(std::fabs(az), std::max(std::fabs(bz), std::fabs(cz)));
+    float max_e = std::max(std::fabs(e0), std::max(std::fabs(e1), std::fabs(e2)));
+    float delta_x = float_gamma(5) * (max_xt + max_zt);
+    float delta_y = float_gamma(5) * (max_yt + max_zt);
+    float delta_z = float_gamma(3) * max_zt;
+    float delta_e = 2 * (float_gamma(2) * max_xt * max_yt + delta_y * max_xt + delta_x * max_yt);
+    float delta_t = 3 * (float_gamma(3) * max_e * max_zt + delta_e * max_zt + delta_z * max_e) * std::fabs(inv_det);
+    // Rounding the vertices and the origin to float moves the plane as well. Rays leaving a hit point
+    // computed in double would otherwise hit the float copy of the same triangle again.
+    Vector3f n = cross(tri.p1 - tri.p0, tri.p2 - tri.p0);
+    float max_p = std::max(max_abs(tri.p0), std::max(max_abs(tri.p1), max_abs(tri.p2))) + max_abs(r.origin);
+    float n_dot_dir = std::fabs(dot(n, Vector3f(ray.dir)));
+    delta_t = std::max(delta_t, 4 * float_gamma(1) * max_p * (std::fabs(n.x) + std::fabs(n.y) + std::fabs(n.z)) / n_dot_dir);
+    if (t_hit <= delta_t || (within_tmax && t_hit >= ray.tmax - delta_t)) {
+        return false;
+    }
+    t = t_hit;
+    uv = Vector2{e1 * inv_det, e2 * inv_det};
+    return true;
+}
+
+static void pack_triangles(BVH &bvh, const std::vector<Shape> &shapes, const std::vector<TriangleMesh> &meshes) {
+    bvh.triangles.resize(shapes.size());
+    parallel_for([&](int64_t i) {
+        PackedTriangle &packed = bvh.triangles[i];
+        if (const Triangle *tri = std::get_if<Triangle>(&shapes[i])) {
+            const TriangleMesh &mesh = meshes[tri->mesh_id];
+            const Vector3i &indices = mesh.indices[tri->face_id];
+            packed.p0 = Vector3f(mesh.positions[indices.x]);
+            packed.p1 = Vector3f(mesh.positions[indices.y]);
+            packed.p2 = Vector3f(mesh.positions[indices.z]);
+            packed.is_triangle = 1;
+        } else {
+            packed = PackedTriangle{};
+            packed.is_triangle = 0;
+        }
+    }, shapes.size(), c_bvh_chunk_size);
+}
+
+template <typename Nodes>
+static std::optional<ShapeHit> bvh_intersect_packed(const Nodes &bvh_nodes,
+                                                    const std::vector<PackedTriangle> &triangles,
+                                                    const std::vector<Shape> &shapes,
+                                                    const std::vector<TriangleMesh>& meshes,
+                                                    Ray ray) {
+    WatertightRay wr = make_watertight_ray(ray);
+    ShapeHit hit{infinity<Real>(), Vector2{0, 0}, -1, -1};
+    bvh_traverse(bvh_nodes, ray, [&](int primitive_id, Ray &r) {
+        const PackedTriangle &tri = triangles[primitive_id];
+        bool hit_primitive = tri.is_triangle ? intersect_packed_triangle(tri, wr, r, false, hit.t, hit.uv)
+                                             : intersect_shape(shapes[primitive_id], meshes, r, hit);
+        if (hit_primitive) {
+            r.tmax = hit.t;
+            hit.shape_id = primitive_id;
+        }
+        return false;
+    });
+    if (hit.shape_id == -1) {
+        return {};
+    }
+    return hit;
+}
+
+template <typename Nodes>
+static bool bvh_occluded_packed(const Nodes &bvh_nodes,
+                                const std::vector<PackedTriangle> &triangles,
+                                const std::vector<Shape> &shapes,
+                                const std::vector<TriangleMesh>& meshes,
+                                Ray ray) {
+    WatertightRay wr = make_watertight_ray(ray);
+    bool occluded = false;
+    bvh_traverse(bvh_nodes, ray, [&](int primitive_id, Ray &r) {
+        const PackedTriangle &tri = triangles[primitive_id];
+        if (tri.is_triangle) {
+            Real t;
+            Vector2 uv;
+            occluded = intersect_packed_triangle(tri, wr, r, true, t, uv);
+        } else {
+            occluded = occluded_shape(shapes[primitive_id], meshes, r);
+        }
+        return occluded;
+    });
+    return occluded;
+}
+
+// The c_primitive_pack_width Reals of a PrimitivePack row processed together by the leaf kernels:
+// one AVX register, two SSE2 registers (one with Real = float) or a plain array.
+// Comparisons return lane masks that only &, | and lanes_select understand.
+#if defined(TAKE_FLOAT) && defined(TAKE_SSE)
+struct Lanes {
+    __m128 v;
+};
+static inline Lanes lanes_load(const float *p) { return {_mm_load_ps(p)}; }
+static inline Lanes lanes_set(float x) { return {_mm_set1_ps(x)}; }
+static inline Lanes operator+(Lanes a, Lanes b) { return {_mm_add_ps(a.v, b.v)}; }
+static inline Lanes operator-(Lanes a, Lanes b) { return {_mm_sub_ps(a.v, b.v)}; }
+static inline Lanes operator-(Lanes a) { return {_mm_xor_ps(a.v, _mm_set1_ps(-0.0f))}; }
+static inline Lanes operator*(Lanes a, Lanes b) { return {_mm_mul_ps(a.v, b.v)}; }
+static inline Lanes operator/(Lanes a, Lanes b) { return {_mm_div_ps(a.v, b.v)}; }
+static inline Lanes lanes_sqrt(Lanes a) { return {_mm_sqrt_ps(a.v)}; }
+static inline Lanes operator<(Lanes a, Lanes b) { return {_mm_cmplt_ps(a.v, b.v)}; }
+static inline Lanes operator&(Lanes a, Lanes b) { return {_mm_and_ps(a.v, b.v)}; }
+static inline Lanes operator|(Lanes a, Lanes b) { return {_mm_or_ps(a.v, b.v)}; }
+static inline Lanes lanes_select(Lanes mask, Lanes a, Lanes b) {
+    return {_mm_or_ps(_mm_and_ps(mask.v, a.v), _mm_andnot_ps(mask.v, b.v))};
+}
+static inline int lanes_mask(Lanes mask) { return _mm_movemask_ps(mask.v); }
+static inline void lanes_store(float *p, Lanes a) { _mm_storeu_ps(p, a.v); }
+#elif defined(TAKE_AVX)
+struct Lanes {
+    __m256d v;
+};
+static inline Lanes lanes_load(const double *p) { return {_mm256_load_pd(p)}; }
+static inline Lanes lanes_set(double x) { return {_mm256_set1_pd(x)}; }
+static inline Lanes operator+(Lanes a, Lanes b) { return {_mm256_add_pd(a.v, b.v)}; }
+static inline Lanes operator-(Lanes a, Lanes b) { return {_mm256_sub_pd(a.v, b.v)}; }
+static inline Lanes operator-(Lanes a) { return {_mm256_xor_pd(a.v, _mm256_set1_pd(-0.0))}; }
+static inline Lanes operator*(Lanes a, Lanes b) { return {_mm256_mul_pd(a.v, b.v)}; }
+static inline Lanes operator/(Lanes a, Lanes b) { return {_mm256_div_pd(a.v, b.v)}; }
+static inline Lanes lanes_sqrt(Lanes a) { return {_mm256_sqrt_pd(a.v)}; }
+static inline Lanes operator<(Lanes a, Lanes b) { return {_mm256_cmp_pd(a.v, b.v, _CMP_LT_OQ)}; }
+static inline Lanes operator&(Lanes a, Lanes b) { return {_mm256_and_pd(a.v, b.v)}; }
+static inline Lanes operator|(Lanes a, Lanes b) { return {_mm256_or_pd(a.v, b.v)}; }
+// a in the lanes set in mask, b in the others
+static inline Lanes lanes_select(Lanes mask, Lanes a, Lanes b) { return {_mm256_blendv_pd(b.v, a.v, mask.v)}; }
+static inline int lanes_mask(Lanes mask) { return _mm256_movemask_pd(mask.v); }
+static inline void lanes_store(double *p, Lanes a) { _mm256_storeu_pd(p, a.v); }
+#elif defined(TAKE_SSE)
+struct Lanes {
+    __m128d lo, hi;
+};
+static inline Lanes lanes_load(const double *p) { return {_mm_load_pd(p), _mm_load_pd(p + 2)}; }
+static inline Lanes lanes_set(double x) { return {_mm_set1_pd(x), _mm_set1_pd(x)}; }
+static inline Lanes operator+(Lanes a, Lanes b) { return {_mm_add_pd(a.lo, b.lo), _mm_add_pd(a.hi, b.hi)}; }
+static inline Lanes operator-(Lanes a, Lanes b) { return {_mm_sub_pd(a.lo, b.lo), _mm_sub_pd(a.hi, b.hi)}; }
+static inline Lanes operator-(Lanes a) {
+    return {_mm_xor_pd(a.lo, _mm_set1_pd(-0.0)), _mm_xor_pd(a.hi, _mm_set1_pd(-0.0))};
+}
+static inline Lanes operator*(Lanes a, Lanes b) { return {_mm_mul_pd(a.lo, b.lo), _mm_mul_pd(a.hi, b.hi)}; }
+static inline Lanes operator/(Lanes a, Lanes b) { return {_mm_div_pd(a.lo, b.lo), _mm_div_pd(a.hi, b.hi)}; }
+static inline Lanes lanes_sqrt(Lanes a) { return {_mm_sqrt_pd(a.lo), _mm_sqrt_pd(a.hi)}; }
+static inline Lanes operator<(Lanes a, Lanes b) { return {_mm_cmplt_pd(a.lo, b.lo), _mm_cmplt_pd(a.hi, b.hi)}; }
+static inline Lanes operator&(Lanes a, Lanes b) { return {_mm_and_pd(a.lo, b.lo), _mm_and_pd(a.hi, b.hi)}; }
+static inline Lanes operator|(Lanes a, Lanes b) { return {_mm_or_pd(a.lo, b.lo), _mm_or_pd(a.hi, b.hi)}; }
+static inline Lanes lanes_select(Lanes mask, Lanes a, Lanes b) {
+    return {_mm_or_pd(_mm_and_pd(mask.lo, a.lo), _mm_andnot_pd(mask.lo, b.lo)),
+            _mm_or_pd(_mm_and_pd(mask.hi, a.hi), _mm_andnot_pd(mask.hi, b.hi))};
+}
+static inline int lanes_mask(Lanes mask) { return _mm_movemask_pd(mask.lo) | (_mm_movemask_pd(mask.hi) << 2); }
+static inline void lanes_store(double *p, Lanes a) {
+    _mm_storeu_pd(p, a.lo);
+    _mm_storeu_pd(p + 2, a.hi);
+}
+#else
+struct Lanes {
+    Real v[c_primitive_pack_width];
+};
+template <typename Op>
+static inline Lanes lanes_apply(Lanes a, Lanes b, Op op) {
+    Lanes r;
+    for (int i = 0; i < c_primitive_pack_width; i++) {
+        r.v[i] = op(a.v[i], b.v[i]);
+    }
+    return r;
+}
+static inline Lanes lanes_load(const Real *p) { return lanes_apply(Lanes{}, Lanes{}, [&](Real, Real) { return *p++; }); }
+static inline Lanes lanes_set(Real x) { return lanes_apply(Lanes{}, Lanes{}, [&](Real, Real) { return x; }); }
+static inline Lanes operator+(Lanes a, Lanes b) { return lanes_apply(a, b, [](Real x, Real y) { return x + y; }); }
+static inline Lanes operator-(Lanes a, Lanes b) { return lanes_apply(a, b, [](Real x, Real y) { return x - y; }); }
+static inline Lanes operator-(Lanes a) { return lanes_apply(a, a, [](Real x, Real) { return -x; }); }
+static inline Lanes operator*(Lanes a, Lanes b) { return lanes_apply(a, b, [](Real x, Real y) { return x * y; }); }
+static inline Lanes operator/(Lanes a, Lanes b) { return lanes_apply(a, b, [](Real x, Real y) { return x / y; }); }
+static inline Lanes lanes_sqrt(Lanes a) { return lanes_apply(a, a, [](Real x, Real) { return sqrt(x); }); }
+static inline Lanes operator<(Lanes a, Lanes b) { return lanes_apply(a, b, [](Real x, Real y) { return Real(x < y); }); }
+static inline Lanes operator&(Lanes a, Lanes b) { return lanes_apply(a, b, [](Real x, Real y) { return Real(x != 0 && y != 0); }); }
+static inline Lanes operator|(Lanes a, Lanes b) { return lanes_apply(a, b, [](Real x, Real y) { return Real(x != 0 || y != 0); }); }
+static inline Lanes lanes_select(Lanes mask, Lanes a, Lanes b) {
+    for (int i = 0; i < c_primitive_pack_width; i++) {
+        a.v[i] = mask.v[i] != 0 ? a.v[i] : b.v[i];
+    }
+    return a;
+}
+static inline int lanes_mask(Lanes mask) {
+    int m = 0;
+    for (int i = 0; i < c_primitive_pack_width; i++) {
+        m |= int(mask.v[i] != 0) << i;
+    }
+    return m;
+}
+static inline void lanes_store(Real *p, Lanes a) {
+    for (int i = 0; i < c_primitive_pack_width; i++) {
+        p[i] = a.v[i];
+    }
+}
+#endif
+
+struct LanesRay {
+    Lanes org[3];
+    Lanes dir[3];
+    Lanes t_min;
+    Lanes t_max;
+};
+
+static LanesRay make_lanes_ray(const Ray &ray) {
+    LanesRay r;
+    for (int axis = 0; axis < 3; axis++) {
+        r.org[axis] = lanes_set(ray.origin[axis]);
+        r.dir[axis] = lanes_set(ray.dir[axis]);
+    }
+    r.t_min = lanes_set(ray.tmin);
+    r.t_max = lanes_set(ray.tmax);
+    return r;
+}
+
+// Möller–Trumbore on all lanes, with the operations of intersect_triangle in the same order
+// so that both accept the same hits. Returns the mask of the lanes hit.
+static int intersect_triangle_lanes(const PrimitivePack &pack, const LanesRay &r, Real t[], Real u[], Real v[]) {
+    Lanes p0x = lanes_load(pack.p0[0]), p0y = lanes_load(pack.p0[1]), p0z = lanes_load(pack.p0[2]);
+    Lanes e1x = lanes_load(pack.e1[0]), e1y = lanes_load(pack.e1[1]), e1z = lanes_load(pack.e1[2]);
+    Lanes e2x = lanes_load(pack.e2[0]), e2y = lanes_load(pack.e2[1]), e2z = lanes_load(pack.e2[2]);
+    const Lanes &dx = r.dir[0], &dy = r.dir[1], &dz = r.dir[2];
+    Lanes hx = dy * e2z - dz * e2y;
+    Lanes hy = dz * e2x - dx * e2z;
+    Lanes hz = dx * e2y - dy * e2x;
+    Lanes a = e1x * hx + e1y * hy + e1z * hz;
+    Lanes miss = (lanes_set(-c_EPSILON) < a) & (a < lanes_set(c_EPSILON));
+    Lanes f = lanes_set(Real(1.0)) / a;
+    Lanes sx = r.org[0] - p0x, sy = r.org[1] - p0y, sz = r.org[2] - p0z;
+    Lanes uu = f * (sx * hx + sy * hy + sz * hz);
+    Lanes zero = lanes_set(Real(0)), one = lanes_set(Real(1));
+    miss = miss | (uu < zero) | (one < uu);
+    int all_lanes = (1 << c_primitive_pack_width) - 1;
+    if (lanes_mask(miss) == all_lanes) {
+        return 0;
+    }
+    Lanes qx = sy * e1z - sz * e1y;
+    Lanes qy = sz * e1x - sx * e1z;
+    Lanes qz = sx * e1y - sy * e1x;
+    Lanes vv = f * (dx * qx + dy * qy + dz * qz);
+    Lanes tt = f * (e2x * qx + e2y * qy + e2z * qz);
+    miss = miss | (vv < zero) | (one < uu + vv) | (tt < r.t_min) | (r.t_max < tt);
+    lanes_store(t, tt);
+    lanes_store(u, uu);
+    lanes_store(v, vv);
+    return ~lanes_mask(miss) & all_lanes;
+}
+
+// Nearest root in [ray.tmin, ray.tmax] on all lanes, in the same way as intersect_sphere.
+static int intersect_sphere_lanes(const PrimitivePack &pack, const LanesRay &r, Real t[]) {
+    const Lanes &dx = r.dir[0], &dy = r.dir[1], &dz = r.dir[2];
+    Lanes ocx = r.org[0] - lanes_load(pack.p0[0]);
+    Lanes ocy = r.org[1] - lanes_load(pack.p0[1]);
+    Lanes ocz = r.org[2] - lanes_load(pack.p0[2]);
+    Lanes radius = lanes_load(pack.e1[0]);
+    Lanes a = dx * dx + dy * dy + dz * dz;
+    Lanes half_b = ocx * dx + ocy * dy + ocz * dz;
+    Lanes c = (ocx * ocx + ocy * ocy + ocz * ocz) - radius * radius;
+    Lanes s = half_b / a;
+    Lanes lx = ocx - s * dx, ly = ocy - s * dy, lz = ocz - s * dz;
+    Lanes discriminant = a * (radius * radius - (lx * lx + ly * ly + lz * lz));
+    int all_lanes = (1 << c_primitive_pack_width) - 1;
+    if (lanes_mask(discriminant < lanes_set(Real(0))) == all_lanes) {
+        // most tests end here, before the square root and the other divisions
+        return 0;
+    }
+    Lanes sqrtd = lanes_sqrt(discriminant);
+    Lanes q = -lanes_select(half_b < lanes_set(Real(0)), half_b - sqrtd, half_b + sqrtd);
+    Lanes root0 = c / q, root1 = q / a;
+    Lanes swap = root1 < root0;
+    Lanes near_root = lanes_select(swap, root1, root0);
+    Lanes far_root = lanes_select(swap, root0, root1);
+    Lanes near_out = (near_root < r.t_min) | (r.t_max < near_root);
+    Lanes far_out = (far_root < r.t_min) | (r.t_max < far_root);
+    Lanes miss = (discriminant < lanes_set(Real(0))) | (near_out & far_out);
+    lanes_store(t, lanes_select(near_out, far_root, near_root));
+    return ~lanes_mask(miss) & all_lanes;
+}
+
+static void pack_primitives(BVH &bvh, const std::vector<Shape> &shapes, const std::vector<TriangleMesh> &meshes) {
+    const int W = c_primitive_pack_width;
+    // Packs never straddle two leaves, they follow the leaves in the order of their shapes.
+    // Single shape leaves have no pack, one lane would cost more than testing the shape directly.
+    std::vector<int> leaf_offsets, leaf_sizes(shapes.size() + 1, 0);
+    for (const BVHNode &node : bvh.nodes) {
+        if (node.num_primitives > 0) {
+            leaf_sizes[node.primitive_offset] = node.num_primitives;
+        }
+    }
+    bvh.first_pack.assign(shapes.size(), -1);
+    int num_packs = 0;
+    for (int i = 0; i < (int)shapes.size(); i++) {
+        if (leaf_sizes[i] > 1) {
+            leaf_offsets.push_back(i);
+            bvh.first_pack[i] = num_packs;
+            num_packs += (leaf_sizes[i] + W - 1) / W;
+        }
+    }
+    bvh.packs.assign(num_packs, PrimitivePack{});
+    parallel_for([&](int64_t leaf) {
+        int offset = leaf_offsets[leaf];
+        for (int i = 0; i < leaf_sizes[offset]; i++) {
+            PrimitivePack &pack = bvh.packs[bvh.first_pack[offset] + i / W];
+            int lane = i % W;
+            const Shape &shape = shapes[offset + i];
+            if (const Triangle *tri = std::get_if<Triangle>(&shape)) {
+                const TriangleMesh &mesh = meshes[tri->mesh_id];
+                const Vector3i &indices = mesh.indices[tri->face_id];
+                Vector3 v0 = mesh.positions[indices.x];
+                Vector3 e1 = mesh.positions[indices.y] - v0;
+                Vector3 e2 = mesh.positions[indices.z] - v0;
+                for (int axis = 0; axis < 3; axis++) {
+                    pack.p0[axis][lane] = v0[axis];
+                    pack.e1[axis][lane] = e1[axis];
+                    pack.e2[axis][lane] = e2[axis];
+                }
+                pack.triangles |= 1 << lane;
+            } else if (const Sphere *sphere = std::get_if<Sphere>(&shape)) {
+                for (int axis = 0; axis < 3; axis++) {
+                    pack.p0[axis][lane] = sphere->center[axis];
+                }
+                pack.e1[0][lane] = sphere->radius;
+                pack.spheres |= 1 << lane;
+            }
+        }
+    }, leaf_offsets.size(), c_bvh_chunk_size);
+}
+
+// Test the first num_lanes lanes of a pack, returning the lanes hit with their distances and barycentrics.
+static int intersect_pack(const PrimitivePack &pack, int num_lanes, const LanesRay &r, Real t[], Real u[], Real v[]) {
+    int lanes = (1 << num_lanes) - 1;
+    int hits = 0;
+    if (lanes & pack.triangles) {
+        hits |= intersect_triangle_lanes(pack, r, t, u, v) & lanes & pack.triangles;
+    }
+    if (lanes & pack.spheres) {
+        Real sphere_t[c_primitive_pack_width];
+        int sphere_hits = intersect_sphere_lanes(pack, r, sphere_t) & lanes & pack.spheres;
+        for (int i = 0; i < c_primitive_pack_width; i++) {
+            if (sphere_hits & (1 << i)) {
+                t[i] = sphere_t[i];
+            }
+        }
+        hits |= sphere_hits;
+    }
+    return hits;
+}
+
+template <typename Nodes>
+static std::optional<ShapeHit> bvh_intersect_packs(const Nodes &bvh_nodes,
+                                                   const BVH &bvh,
+                                                   const std::vector<Shape> &shapes,
+                                                   const std::vector<TriangleMesh>& meshes,
+                                                   Ray ray) {
+    const int W = c_primitive_pack_width;
+    LanesRay lanes_ray = make_lanes_ray(ray);
+    ShapeHit hit{infinity<Real>(), Vector2{0, 0}, -1, -1};
+    bvh_traverse_leaves(bvh_nodes, ray, [&](int primitive_offset, int num_primitives, Ray &r) {
+        if (num_primitives == 1) {
+            if (intersect_shape(shapes[primitive_offset], meshes, r, hit)) {
+                r.tmax = hit.t;
+                hit.shape_id = primitive_offset;
+            }
+            return false;
+        }
+        const PrimitivePack *pack = &bvh.packs[bvh.first_pack[primitive_offset]];
+        for (int first = primitive_offset; first < primitive_offset + num_primitives; first += W, pack++) {
+            int num_lanes = std::min(primitive_offset + num_primitives - first, W);
+            Real t[W], u[W], v[W];
+            lanes_ray.t_max = lanes_set(r.tmax);
+            int hits = intersect_pack(*pack, num_lanes, lanes_ray, t, u, v);
+            int others = ((1 << num_lanes) - 1) & ~(pack->triangles | pack->spheres);
+            // Lanes in order, so that ties are resolved like in the one-by-one tests
+            for (int i = 0; i < W; i++) {
+                bool hit_lane = false;
+                if (hits & (1 << i)) {
+                    if (t[i] <= r.tmax) {
+                        hit.t = t[i];
+                        hit.uv = Vector2{u[i], v[i]};
+                        hit_lane = true;
+                    }
+                } else if (others & (1 << i)) {
+                    hit_lane = intersect_shape(shapes[first + i], meshes, r, hit);
+                }
+                if (hit_lane) {
+                    r.tmax = hit.t;
+                    hit.shape_id = first + i;
+                }
+            }
+        }
+        return false;
+    });
+    if (hit.shape_id == -1) {
+        return {};
+    }
+    return hit;
+}
+
+template <typename Nodes>
+static bool bvh_occluded_packs(const Nodes &bvh_nodes,
+                               const BVH &bvh,
+                               const std::vector<Shape> &shapes,
+                               const std::vector<TriangleMesh>& meshes,
+                               Ray ray) {
+    const int W = c_primitive_pack_width;
+    LanesRay lanes_ray = make_lanes_ray(ray);
+    bool occluded = false;
+    bvh_traverse_leaves(bvh_nodes, ray, [&](int primitive_offset, int num_primitives, Ray &r) {
+        if (num_primitives == 1) {
+            occluded = occluded_shape(shapes[primitive_offset], meshes, r);
+            return occluded;
+        }
+        const PrimitivePack *pack = &bvh.packs[bvh.first_pack[primitive_offset]];
+        for (int first = primitive_offset; first < primitive_offset + num_primitives; first += W, pack++) {
+            int num_lanes = std::min(primitive_offset + num_primitives - first, W);
+            Real t[W], u[W], v[W];
+            if (intersect_pack(*pack, num_lanes, lanes_ray, t, u, v)) {
+                occluded = true;
+                return true;
+            }
+            int others = ((1 << num_lanes) - 1) & ~(pack->triangles | pack->spheres);
+            for (int i = 0; i < W; i++) {
+                if ((others & (1 << i)) && occluded_shape(shapes[first + i], meshes, r)) {
+                    occluded = true;
+                    return true;
+                }
+            }
+        }
+        return false;
+    });
+    return occluded;
+}
+
+// Float copy of the rays of a packet, one entry per ray so that the box tests run across rays.
+struct alignas(32) PacketRays {
+    float org[3][c_ray_packet_size];
+    float inv_dir[3][c_ray_packet_size];
+    float t_min[c_ray_packet_size];
+    float t_max[c_ray_packet_size];
+    // -1 when the rays disagree on the sign of the direction along the axis
+    int dir_is_neg[3];
+};
+
+static void make_packet_rays(const Ray rays[], int num_rays, PacketRays &p) {
+    for (int i = 0; i < c_ray_packet_size; i++) {
+        // unused entries repeat the last ray, they are never in the active mask
+        const Ray &ray = rays[std::min(i, num_rays - 1)];
+        for (int axis = 0; axis < 3; axis++) {
+            p.org[axis][i] = float(ray.origin[axis]);
+            p.inv_dir[axis][i] = float(Real(1) / ray.dir[axis]);
+        }
+        p.t_min[i] = round_down(ray.tmin);
+        p.t_max[i] = round_up(ray.tmax);
+    }
+    for (int axis = 0; axis < 3; axis++) {
+        p.dir_is_neg[axis] = p.inv_dir[axis][0] < 0;
+        for (int i = 1; i < num_rays; i++) {
+            if (int(p.inv_dir[axis][i] < 0) != p.dir_is_neg[axis]) {
+                p.dir_is_neg[axis] = -1;
+            }
+        }
+    }
+}
+
+// Test the rays in mask against one box, returns the mask of the rays that hit it
+// and writes their entry distances to t_near.
+// The near plane is selected per ray only along the axes where the rays of the packet disagree on the direction.
+static int intersect_box_packet(const float lo[3], const float hi[3], const PacketRays &p, int mask, float t_near[]) {
+    int hits = 0;
+#if defined(TAKE_SSE)
+    for (int i = 0; i < c_ray_packet_size; i += 4) {
+        if (!((mask >> i) & 0xf)) {
+            continue;
+        }
+        __m128 t0 = _mm_load_ps(p.t_min + i);
+        __m128 far_t = _mm_set1_ps(infinity<float>());
+        for (int axis = 0; axis < 3; axis++) {
+            __m128 o = _mm_load_ps(p.org[axis] + i);
+            __m128 inv = _mm_load_ps(p.inv_dir[axis] + i);
+            __m128 near_a, far_a;
+            if (p.dir_is_neg[axis] >= 0) {
+                near_a = _mm_set1_ps(p.dir_is_neg[axis] ? hi[axis] : lo[axis]);
+                far_a = _mm_set1_ps(p.dir_is_neg[axis] ? lo[axis] : hi[axis]);
+            } else {
+                __m128 neg = _mm_cmplt_ps(inv, _mm_setzero_ps());
+                __m128 l = _mm_set1_ps(lo[axis]), h = _mm_set1_ps(hi[axis]);
+                near_a = _mm_or_ps(_mm_and_ps(neg, h), _mm_andnot_ps(neg, l));
+                far_a = _mm_or_ps(_mm_and_ps(neg, l), _mm_andnot_ps(neg, h));
+            }
+            t0 = _mm_max_ps(_mm_mul_ps(_mm_sub_ps(near_a, o), inv), t0);
+            far_t = _mm_min_ps(_mm_mul_ps(_mm_sub_ps(far_a, o), inv), far_t);
+        }
+        __m128 t1 = _mm_min_ps(_mm_mul_ps(far_t, _mm_set1_ps(c_slab_far_scale)), _mm_load_ps(p.t_max + i));
+        _mm_storeu_ps(t_near + i, t0);
+        hits |= _mm_movemask_ps(_mm_cmple_ps(t0, t1)) << i;
+    }
+#else
+    for (int i = 0; i < c_ray_packet_size; i++) {
+        if (!(mask & (1 << i))) {
+            continue;
+        }
+        float t0 = p.t_min[i], t1 = infinity<float>();
+        for (int axis = 0; axis < 3; axis++) {
+            bool neg = p.inv_dir[axis][i] < 0;
+            float t_enter = ((neg ? hi : lo)[axis] - p.org[axis][i]) * p.inv_dir[axis][i];
+            float t_exit = ((neg ? lo : hi)[axis] - p.org[axis][i]) * p.inv_dir[axis][i];
+            t0 = t_enter > t0 ? t_enter : t0;
+            t1 = t_exit < t1 ? t_exit : t1;
+        }
+        t1 = std::min(t1 * c_slab_far_scale, p.t_max[i]);
+        t_near[i] = t0;
+        hits |= int(t0 <= t1) << i;
+    }
+#endif
+    return hits & mask;
+}
+
+static int first_ray(int mask) {
+    int i = 0;
+    while (!(mask & (1 << i))) {
+        i++;
+    }
+    return i;
+}
+
+// Packet version of bvh_traverse_leaves: the rays in active walk the tree together and every node is
+// fetched once for all of them. Each stack entry keeps the mask of the rays that reached it.
+// on_leaf(primitive_offset, num_primitives, mask) tests the leaf against the rays in mask, lowering
+// p.t_max of the rays it hit, and returns the mask of the rays that are done.
+template <typename LeafFunc>
+static void bvh_traverse_packet_leaves(const std::vector<LinearBVHNode> &bvh_nodes, PacketRays &p, int active,
+                                       LeafFunc on_leaf) {
+    if (bvh_nodes.empty()) {
+        return;
+    }
+    struct StackEntry {
+        int node_id;
+        int mask;
+    };
+    StackEntry stack[BVH_STACK_DEPTH];
+    int stack_size = 0;
+    stack[stack_size++] = {0, active};
+    float t_near[c_ray_packet_size];
+    while (stack_size > 0) {
+        StackEntry entry = stack[--stack_size];
+        const LinearBVHNode &node = bvh_nodes[entry.node_id];
+        float lo[3] = {node.p_min.x, node.p_min.y, node.p_min.z};
+        float hi[3] = {node.p_max.x, node.p_max.y, node.p_max.z};
+        int mask = intersect_box_packet(lo, hi, p, entry.mask & active, t_near);
+        if (!mask) {
+            continue;
+        }
+        if (node.num_primitives > 0) {
+            active &= ~on_leaf(node.primitive_offset, node.num_primitives, mask);
+            if (!active) {
+                return;
+            }
+        } else if (p.inv_dir[node.axis][first_ray(mask)] < 0) {
+            // The packet is ordered by the direction of its first ray
+            stack[stack_size++] = {entry.node_id + 1, mask};
+            stack[stack_size++] = {node.second_child_offset, mask};
+        } else {
+            stack[stack_size++] = {node.second_child_offset, mask};
+            stack[stack_size++] = {entry.node_id + 1, mask};
+        }
+    }
+}
+
+template <template <int> class WideNode, int N, typename LeafFunc>
+static void bvh_traverse_packet_leaves(const std::vector<WideNode<N>> &bvh_nodes, PacketRays &p, int active,
+                                       LeafFunc on_leaf) {
+    if (bvh_nodes.empty()) {
+        return;
+    }
+    struct StackEntry {
+        int node_id;
+        int mask;
+        float t_near;
+    };
+    StackEntry stack[BVH_STACK_DEPTH * (N - 1) + 1];
+    int stack_size = 0;
+    stack[stack_size++] = {0, active, 0};
+    float t_near[c_ray_packet_size];
+    while (stack_size > 0) {
+        StackEntry entry = stack[--stack_size];
+        int mask = entry.mask & active;
+        if (!mask) {
+            continue;
+        }
+        const WideNode<N> &node = bvh_nodes[entry.node_id];
+        WideBVHNode<N> decoded;
+        const float (&bounds)[2][3][N] = child_bounds(node, decoded);
+        StackEntry hits[N];
+        int num_hits = 0;
+        for (int i = 0; i < N && node.children[i] != c_wide_bvh_empty; i++) {
+            float lo[3] = {bounds[0][0][i], bounds[0][1][i], bounds[0][2][i]};
+            float hi[3] = {bounds[1][0][i], bounds[1][1][i], bounds[1][2][i]};
+            int child_mask = intersect_box_packet(lo, hi, p, mask, t_near);
+            if (!child_mask) {
+                continue;
+            }
+            int child = node.children[i];
+            if (is_wide_bvh_leaf(child)) {
+                active &= ~on_leaf(wide_bvh_primitive_offset(child), wide_bvh_num_primitives(child), child_mask);
+                if (!active) {
+                    return;
+                }
+                mask &= active;
+            } else {
+                // sorted by the entry distance of the first ray, nearest on top of the stack
+                float t = t_near[first_ray(child_mask)];
+                int j = num_hits++;
+                for (; j > 0 && hits[j - 1].t_near < t; j--) {
+                    hits[j] = hits[j - 1];
+                }
+                hits[j] = {child, child_mask, t};
+            }
+        }
+        for (int i = 0; i < num_hits; i++) {
+            stack[stack_size++] = hits[i];
+        }
+    }
+}
+
+template <typename Nodes>
+static void bvh_intersect_packet(const Nodes &bvh_nodes,
+                                 const std::vector<Shape> &shapes,
+                                 const std::vector<TriangleMesh>& meshes,
+                                 const Ray rays[],
+                                 int num_rays,
+                                 std::optional<ShapeHit> hits[]) {
+    PacketRays p;
+    make_packet_rays(rays, num_rays, p);
+    Ray r[c_ray_packet_size];
+    ShapeHit hit[c_ray_packet_size];
+    for (int i = 0; i < num_rays; i++) {
+        r[i] = rays[i];
+        hit[i] = ShapeHit{infinity<Real>(), Vector2{0, 0}, -1, -1};
+    }
+    bvh_traverse_packet_leaves(bvh_nodes, p, (1 << num_rays) - 1, [&](int primitive_offset, int num_primitives, int mask) {
+        for (int i = 0; i < num_rays; i++) {
+            if (!(mask & (1 << i))) {
+                continue;
+            }
+            for (int j = primitive_offset; j < primitive_offset + num_primitives; j++) {
+                if (intersect_shape(shapes[j], meshes, r[i], hit[i])) {
+                    r[i].tmax = hit[i].t;
+                    hit[i].shape_id = j;
+                }
+            }
+            p.t_max[i] = round_up(r[i].tmax);
+        }
+        return 0;
+    });
+    for (int i = 0; i < num_rays; i++) {
+        hits[i] = hit[i].shape_id == -1 ? std::optional<ShapeHit>{} : hit[i];
+    }
+}
+
+template <typename Nodes>
+static void bvh_occluded_packet(const Nodes &bvh_nodes,
+                                const std::vector<Shape> &shapes,
+                                const std::vector<TriangleMesh>& meshes,
+                                const Ray rays[],
+                                int num_rays,
+                                bool occluded[]) {
+    PacketRays p;
+    make_packet_rays(rays, num_rays, p);
+    for (int i = 0; i < num_rays; i++) {
+        occluded[i] = false;
+    }
+    bvh_traverse_packet_leaves(bvh_nodes, p, (1 << num_rays) - 1, [&](int primitive_offset, int num_primitives, int mask) {
+        int done = 0;
+        for (int i = 0; i < num_rays; i++) {
+            if (!(mask & (1 << i))) {
+                continue;
+            }
+            for (int j = primitive_offset; j < primitive_offset + num_primitives && !occluded[i]; j++) {
+                occluded[i] = occluded_shape(shapes[j], meshes, rays[i]);
+            }
+            done |= int(occluded[i]) << i;
+        }
+        return done;
+    });
+}
+
+// Treelets of the treelet layout hold up to 4 KB of traversal nodes: 36 BVH4, 18 BVH8, 73 quantized BVH4
+// or 42 quantized BVH8 nodes. The node array is not page aligned and treelets grown from small subtrees
+// stay partly filled, so a treelet bounds the bytes its nodes span rather than matching a page.
+const int c_bvh_treelet_bytes = 4096;
+
+template <int N>
+static void collapse_traversal_nodes(BVH &bvh, bool treelets, int node_bytes, std::vector<WideBVHNode<N>> &wide_nodes) {
+    collapse_bvh(bvh.root_id, bvh.nodes, wide_nodes, &bvh.node_slots);
+    if (treelets) {
+        reorder_bvh_treelets(wide_nodes, bvh.node_slots, std::max(c_bvh_treelet_bytes / node_bytes, 1));
+    }
+}
+
+template <int N>
+static void collapse_quantized_bvh(BVH &bvh, bool treelets, std::vector<QuantizedBVHNode<N>> &quantized_nodes) {
+    std::vector<WideBVHNode<N>> wide_nodes;
+    collapse_traversal_nodes(bvh, treelets, sizeof(QuantizedBVHNode<N>), wide_nodes);
+    quantize_bvh(wide_nodes, quantized_nodes);
+}
+
+static void build_traversal_nodes(BVH &bvh, const BVHBuildOptions &options) {
+    bvh.linear_nodes.clear();
+    bvh.bvh4_nodes.clear();
+    bvh.bvh8_nodes.clear();
+    bvh.qbvh4_nodes.clear();
+    bvh.qbvh8_nodes.clear();
+    if (options.width == 8 && options.quantized) {
+        collapse_quantized_bvh(bvh, options.treelets, bvh.qbvh8_nodes);
+    } else if (options.width == 4 && options.quantized) {
+        collapse_quantized_bvh(bvh, options.treelets, bvh.qbvh4_nodes);
+    } else if (options.width == 8) {
+        collapse_traversal_nodes(bvh, options.treelets, sizeof(BVH8Node), bvh.bvh8_nodes);
+    } else if (options.width == 4) {
+        collapse_traversal_nodes(bvh, options.treelets, sizeof(BVH4Node), bvh.bvh4_nodes);
+    } else {
+        flatten_bvh(bvh.root_id, bvh.nodes, bvh.linear_nodes, &bvh.node_slots);
+    }
+}
+
+template <int N>
+static void set_child_bounds(WideBVHNode<N> &node, int child, const BBox &box) {
+    for (int axis = 0; axis < 3; axis++) {
+        node.bounds[0][axis][child] = round_down(box.p_min[axis]);
+        node.bounds[1][axis][child] = round_up(box.p_max[axis]);
+    }
+}
+
+// Copy the refitted bounds into the traversal layout, whose topology did not change.
+// Requantize every node from the refitted bounds of its children.
+template <int N>
+static void refit_quantized_nodes(const BVH &bvh, std::vector<QuantizedBVHNode<N>> &quantized_nodes) {
+    parallel_for([&](int64_t node_id) {
+        WideBVHNode<N> node;
+        for (int i = 0; i < N; i++) {
+            int slot = int(node_id) * N + i;
+            if (bvh.node_slots[slot] >= 0) {
+                set_child_bounds(node, i, bvh.nodes[bvh.node_slots[slot]].box);
+            }
+            node.children[i] = quantized_nodes[node_id].children[i];
+        }
+        quantized_nodes[node_id] = quantize_bvh_node(node);
+    }, quantized_nodes.size(), c_bvh_chunk_size);
+}
+
+static void refit_traversal_nodes(BVH &bvh) {
+    if (!bvh.qbvh8_nodes.empty()) {
+        refit_quantized_nodes(bvh, bvh.qbvh8_nodes);
+        return;
+    } else if (!bvh.qbvh4_nodes.empty()) {
+        refit_quantized_nodes(bvh, bvh.qbvh4_nodes);
+        return;
+    }
+    parallel_for([&](int64_t slot) {
+        int node_id = bvh.node_slots[slot];
+        if (node_id < 0) {
+            return;
+        }
+        const BBox &box = bvh.nodes[node_id].box;
+        if (!bvh.bvh8_nodes.empty()) {
+            set_child_bounds(bvh.bvh8_nodes[slot / 8], slot % 8, box);
+        } else if (!bvh.bvh4_nodes.empty()) {
+            set_child_bounds(bvh.bvh4_nodes[slot / 4], slot % 4, box);
+        } else {
+            LinearBVHNode &node = bvh.linear_nodes[slot];
+            for (int axis = 0; axis < 3; axis++) {
+                node.p_min[axis] = round_down(box.p_min[axis]);
+                node.p_max[axis] = round_up(box.p_max[axis]);
+            }
+        }
+    }, bvh.node_slots.size(), c_bvh_chunk_size);
+}
+
+void build_bvh(BVH &bvh,
+               std::vector<Shape> &shapes,
+               const std::vector<TriangleMesh> &meshes,
+               const BVHBuildOptions &options,
+               std::vector<int> &new_shape_id) {
+    std::vector<int> unique_id;
+    if (bvh.first_copy.size() == shapes.size()) {
+        // Drop the copies of the shapes split by the previous SBVH build and start from one copy of each.
+        std::vector<Shape> unique_shapes;
+        unique_id.resize(shapes.size());
+        for (int i = 0; i < (int)shapes.size(); i++) {
+            if (bvh.first_copy[i] == i) {
+                unique_id[i] = (int)unique_shapes.size();
+                unique_shapes.push_back(shapes[i]);
+            } else {
+                unique_id[i] = unique_id[bvh.first_copy[i]];
+            }
+        }
+        shapes.swap(unique_shapes);
+    }
+    std::vector<BBox> bboxes(shapes.size());
+    parallel_for([&](int64_t i) {
+        bboxes[i] = get_bbox(shapes[i], meshes);
+    }, bboxes.size(), c_bvh_chunk_size);
+    bvh.nodes.clear();
+    bvh.nodes.shrink_to_fit();
+    std::vector<int> order;
+    // Leaves are cheaper when their primitives are tested a pack at a time, so let the builders make them bigger
+    int leaf_block = options.triangle_store == TriangleStore::Simd ? c_primitive_pack_width : 1;
+    if (options.method == BVHBuildMethod::SAH) {
+        bvh.root_id = construct_bvh_sah(bboxes, bvh.nodes, order, leaf_block);
+    } else if (options.method == BVHBuildMethod::SBVH) {
+        auto split_primitive = [&](int id, int axis, Real pos, const BBox &box) {
+            return split_bbox(shapes[id], meshes, axis, pos, box);
+        };
+        bvh.root_id = construct_sbvh(bboxes, split_primitive, options.spatial_split_budget, bvh.nodes, order,
+                                     leaf_block);
+    } else if (options.method == BVHBuildMethod::LBVH) {
+        bvh.root_id = construct_lbvh(bboxes, bvh.nodes, order, leaf_block);
+    } else {
+        bvh.root_id = construct_bvh(bboxes, bvh.nodes, order, leaf_block);
+    }
+
+    // Store the shapes in leaf order so that every leaf references consecutive shapes.
+    // A shape referenced by several leaves is copied into each of them.
+    std::vector<Shape> sorted_shapes(order.size());
+    new_shape_id.resize(shapes.size());
+    parallel_for([&](int64_t i) {
+        sorted_shapes[i] = shapes[order[i]];
+    }, order.size(), c_bvh_chunk_size);
+    for (int i = (int)order.size() - 1; i >= 0; i--) {
+        new_shape_id[order[i]] = i;
+    }
+    bvh.first_copy.clear();
+    if (order.size() != shapes.size()) {
+        bvh.first_copy.resize(order.size());
+        for (int i = 0; i < (int)order.size(); i++) {
+            bvh.first_copy[i] = new_shape_id[order[i]];
+        }
+    }
+    shapes.swap(sorted_shapes);
+
+    if (!unique_id.empty()) {
+        for (int &id : unique_id) {
+            id = new_shape_id[id];
+        }
+        new_shape_id.swap(unique_id);
+    }
+    build_traversal_nodes(bvh, options);
+    bvh.build_sah_cost = bvh_sah_cost(bvh.root_id, bvh.nodes);
+    bvh.box = bvh.root_id == -1 ? BBox() : bvh.nodes[bvh.root_id].box;
+    bvh.triangles.clear();
+    bvh.packs.clear();
+    bvh.first_pack.clear();
+    if (options.triangle_store == TriangleStore::Float) {
+        pack_triangles(bvh, shapes, meshes);
+    } else if (options.triangle_store == TriangleStore::Simd) {
+        pack_primitives(bvh, shapes, meshes);
+    }
+    if (!options.refit) {
+        // Traversal only reads the layout built from the binary tree, whose 64 byte nodes would outweigh it
+        std::vector<BVHNode>().swap(bvh.nodes);
+        std::vector<int>().swap(bvh.node_slots);
+    }
+}
+
+void refit_bvh(BVH &bvh, const std::vector<Shape> &shapes, const std::vector<TriangleMesh> &meshes) {
+    if (bvh.root_id == -1) {
+        return;
+    }
+    if (bvh.nodes.empty()) {
+        Error("Refitting a BVH needs the binary tree, build it with BVHBuildOptions::refit.");
+    }
+    std::vector<BVHNode> &nodes = bvh.nodes;
+    auto refit_node = [&](int node_id) {
+        BVHNode &node = nodes[node_id];
+        if (node.num_primitives > 0) {
+            BBox box;
+            for (int i = 0; i < node.num_primitives; i++) {
+                box = merge(box, get_bbox(shapes[node.primitive_offset + i], meshes));
+            }
+            node.box = box;
+        } else {
+            node.box = merge(nodes[node.left_node_id].box, nodes[node.right_node_id].box);
+        }
+    };
+    // Every builder stores a subtree contiguously in post-order, left subtree first,
+    // so the subtree of a node spans [first_node[node], node] and can be refit in index order.
+    std::vector<int> first_node(nodes.size());
+    for (int i = 0; i < (int)nodes.size(); i++) {
+        first_node[i] = nodes[i].num_primitives > 0 ? i : first_node[nodes[i].left_node_id];
+    }
+    // Split the top of the tree like the builders do and refit the subtrees below it in parallel.
+    std::vector<int> roots{bvh.root_id}, tasks, top_nodes;
+    while (!roots.empty()) {
+        std::vector<int> next_roots;
+        for (int node_id : roots) {
+            if (node_id - first_node[node_id] + 1 <= c_bvh_task_size) {
+                tasks.push_back(node_id);
+                continue;
+            }
+            top_nodes.push_back(node_id);
+            next_roots.push_back(nodes[node_id].left_node_id);
+            next_roots.push_back(nodes[node_id].right_node_id);
+        }
+        roots.swap(next_roots);
+    }
+    parallel_for([&](int64_t t) {
+        for (int i = first_node[tasks[t]]; i <= tasks[t]; i++) {
+            refit_node(i);
+        }
+    }, tasks.size());
+    for (auto it = top_nodes.rbegin(); it != top_nodes.rend(); it++) {
+        refit_node(*it);
+    }
+    bvh.box = nodes[bvh.root_id].box;
+    refit_traversal_nodes(bvh);
+    if (!bvh.triangles.empty()) {
+        pack_triangles(bvh, shapes, meshes);
+    }
+    if (!bvh.packs.empty()) {
+        pack_primitives(bvh, shapes, meshes);
+    }
+}
+
+bool update_bvh(BVH &bvh,
+                std::vector<Shape> &shapes,
+                const std::vector<TriangleMesh> &meshes,
+                const BVHBuildOptions &options,
+                std::vector<int> &new_shape_id) {
+    refit_bvh(bvh, shapes, meshes);
+    if (bvh_sah_cost(bvh.root_id, bvh.nodes) <= options.rebuild_threshold * bvh.build_sah_cost) {
+        return false;
+    }
+    build_bvh(bvh, shapes, meshes, options, new_shape_id);
+    return true;
+}
+
+// Call f with the traversal layout of bvh that is built.
+template <typename Func>
+static auto visit_traversal_nodes(const BVH &bvh, Func f) {
+    if (!bvh.qbvh8_nodes.empty()) {
+        return f(bvh.qbvh8_nodes);
+    } else if (!bvh.qbvh4_nodes.empty()) {
+        return f(bvh.qbvh4_nodes);
+    } else if (!bvh.bvh8_nodes.empty()) {
+        return f(bvh.bvh8_nodes);
+    } else if (!bvh.bvh4_nodes.empty()) {
+        return f(bvh.bvh4_nodes);
+    }
+    return f(bvh.linear_nodes);
+}
+
+size_t traversal_nodes_bytes(const BVH &bvh) {
+    return visit_traversal_nodes(bvh, [](const auto &nodes) {
+        return nodes.size() * sizeof(nodes[0]);
+    });
+}
+size_t bvh_bytes(const BVH &bvh) {
+    return bvh.nodes.size() * sizeof(BVHNode) + bvh.node_slots.size() * sizeof(int) + traversal_nodes_bytes(bvh) +
+           bvh.first_copy.size() * sizeof(int) + bvh.triangles.size() * sizeof(PackedTriangle) +
+           bvh.packs.size() * sizeof(PrimitivePack) + bvh.first_pack.size() * sizeof(int);
+}
+
+std::optional<ShapeHit> bvh_intersect(const BVH &bvh,
+                                      const std::vector<Shape> &shapes,
+                                      const std::vector<TriangleMesh>& meshes,
+                                      const Ray &ray) {
+    return visit_traversal_nodes(bvh, [&](const auto &nodes) {
+        if (!bvh.packs.empty()) {
+            return bvh_intersect_packs(nodes, bvh, shapes, meshes, ray);
+        } else if (!bvh.triangles.empty()) {
+            return bvh_intersect_packed(nodes, bvh.triangles, shapes, meshes, ray);
+        }
+        return bvh_intersect(nodes, shapes, meshes, ray);
+    });
+}
+
+bool bvh_occluded(const BVH &bvh,
+                  const std::vector<Shape> &shapes,
+                  const std::vector<TriangleMesh>& meshes,
+                  const Ray &ray) {
+    return visit_traversal_nodes(bvh, [&](const auto &nodes) {
+        if (!bvh.packs.empty()) {
+            return bvh_occluded_packs(nodes, bvh, shapes, meshes, ray);
+        } else if (!bvh.triangles.empty()) {
+            return bvh_occluded_packed(nodes, bvh.triangles, shapes, meshes, ray);
+        }
+        return bvh_occluded(nodes, shapes, meshes, ray);
+    });
+}
+
+void bvh_intersect_packet(const BVH &bvh,
+                          const std::vector<Shape> &shapes,
+                          const std::vector<TriangleMesh>& meshes,
+                          const Ray rays[],
+                          int num_rays,
+                          std::optional<ShapeHit> hits[]) {
+    visit_traversal_nodes(bvh, [&](const auto &nodes) {
+        bvh_intersect_packet(nodes, shapes, meshes, rays, num_rays, hits);
+    });
+}
+
+void bvh_occluded_packet(const BVH &bvh,
+                         const std::vector<Shape> &shapes,
+                         const std::vector<TriangleMesh>& meshes,
+                         const Ray rays[],
+                         int num_rays,
+                         bool occluded[]) {
+    visit_traversal_nodes(bvh, [&](const auto &nodes) {
+        bvh_occluded_packet(nodes, shapes, meshes, rays, num_rays, occluded);
+    });
 }
\ No newline at end of file
@@ -1,13 +1,237 @@
 #pragma once
 #include "bbox.h"
 #include "shape.h"
+#include <functional>
 
+enum class BVHBuildMethod {
+    Median, // split at the median primitive along the largest axis
+    SAH,    // binned surface area heuristic
+    LBVH,   // linear BVH over Morton-sorted primitives, fastest to build
+    SBVH    // SAH with spatial splits that clip primitives (Stich et al. 2009), slowest to build
+};
+
+enum class TriangleStore {
+    Mesh, // triangles are read from their mesh through the shape, no extra memory
+    Float, // float copy of the vertices in leaf order with a watertight test, 40 bytes per shape
+    Simd   // triangles and spheres in SoA packs (see PrimitivePack) tested 4 at a time with SSE/AVX, 80 bytes per shape
+};
+
+struct BVHBuildOptions {
+    BVHBuildMethod method = BVHBuildMethod::SAH;
+    int width = 4; // 2 (binary), 4 or 8 children per traversal node
+    // SBVH only: extra primitive references spatial splits may create, as a fraction of the primitive count
+    Real spatial_split_budget = Real(0.5);
+    // update_bvh rebuilds instead of refitting once the SAH cost grew by more than this factor since the last build
+    Real rebuild_threshold = Real(1.5);
+    TriangleStore triangle_store = TriangleStore::Mesh;
+    // Width 4 and 8 only: store the child bounds of the traversal nodes in 8 bits (see QuantizedBVHNode)
+    bool quantized = false;
+    // Width 4 and 8 only: store the traversal nodes in treelets of likely visited nodes instead of depth-first
+    bool treelets = false;
+    // Keep the binary tree after the build for refit_bvh and update_bvh, otherwise only the traversal layout is kept
+    bool refit = false;
+};
+
+// Leaves reference num_primitives consecutive entries of the primitive order returned by the builders,
+// starting at primitive_offset. Interior nodes have num_primitives == 0.
 struct BVHNode {
     BBox box;
     int left_node_id;
     int right_node_id;
-    int primitive_id;
+    int primitive_offset;
+    int num_primitives;
+};
+
+// Upper bound on the number of primitives the builders put in one leaf.
+constexpr int c_bvh_max_leaf_size = 8;
+
+// Depth-first flattened node used for traversal (pbrt-v3 4.3.4).
+// The first child of an interior node directly follows it, only the second one is stored.
+// Bounds are rounded outwards to float so that a node fits in 32 bytes.
+struct LinearBVHNode {
+    Vector3f p_min;
+    Vector3f p_max;
+    union {
+        int primitive_offset;    // leaf
+        int second_child_offset; // interior
+    };
+    uint16_t num_primitives;     // 0 for interior nodes
+    uint8_t axis;                // axis the children are ordered along
+    uint8_t pad;
+};
+static_assert(sizeof(LinearBVHNode) == 32, "LinearBVHNode should be 32 bytes");
+
+// Collapsed N-wide node (N = 4 or 8) whose child bounds are stored in SoA form
+// so that all children are tested against a ray at once with SSE/AVX.
+// bounds[0] holds the lower corners and bounds[1] the upper corners, one float per child and axis.
+// children[i] is the index of an interior node, c_wide_bvh_empty for an unused slot,
+// or encodes the primitive range of a leaf (see wide_bvh_leaf).
+template <int N>
+struct alignas(4 * N) WideBVHNode {
+    float bounds[2][3][N];
+    int children[N];
 };
+using BVH4Node = WideBVHNode<4>;
+using BVH8Node = WideBVHNode<8>;
+
+// Wide node with the child bounds quantized to 8 bits on a grid over the node (Ylitie et al. 2017),
+// less than half the size of a WideBVHNode. Along every axis child i spans
+// [origin + q[0][axis][i] * 2^exponent[axis], origin + q[1][axis][i] * 2^exponent[axis]] in float arithmetic,
+// rounded outward so that it contains the float bounds of the child. The first num_children children are used.
+template <int N>
+struct QuantizedBVHNode {
+    float origin[3];
+    int8_t exponent[3];
+    uint8_t num_children;
+    uint8_t q[2][3][N];
+    int children[N];
+};
+using QBVH4Node = QuantizedBVHNode<4>;
+using QBVH8Node = QuantizedBVHNode<8>;
+static_assert(sizeof(QBVH4Node) == 56 && sizeof(QBVH8Node) == 96, "unexpected QuantizedBVHNode size");
+
+// A leaf child packs its primitive offset and count - 1 (3 bits) into one negative int.
+constexpr int c_wide_bvh_empty = -1;
+static_assert(c_bvh_max_leaf_size <= 8, "leaf size does not fit in a wide BVH child");
+inline int wide_bvh_leaf(int primitive_offset, int num_primitives) {
+    return -2 - ((primitive_offset << 3) | (num_primitives - 1));
+}
+inline bool is_wide_bvh_leaf(int child) {
+    return child < c_wide_bvh_empty;
+}
+inline int wide_bvh_primitive_offset(int child) {
+    return (-2 - child) >> 3;
+}
+inline int wide_bvh_num_primitives(int child) {
+    return ((-2 - child) & 7) + 1;
+}
+
+// Vertices of the triangle at the same index of the shape array, so that a leaf reads consecutive memory
+// instead of going through the shape and its mesh. Entries of other shapes have is_triangle == 0.
+struct PackedTriangle {
+    Vector3f p0, p1, p2;
+    int is_triangle;
+};
+
+// Up to 4 shapes of a leaf in SoA form, so that the triangles and spheres of the leaf are tested together.
+// Triangle lanes hold the first vertex and the edges to the other two, sphere lanes the center and
+// the radius in e1[0]. Lanes of other shapes are tested through the Shape.
+constexpr int c_primitive_pack_width = 4;
+struct alignas(32) PrimitivePack {
+    Real p0[3][c_primitive_pack_width];
+    Real e1[3][c_primitive_pack_width];
+    Real e2[3][c_primitive_pack_width];
+    int triangles; // bit mask of the triangle lanes
+    int spheres;   // bit mask of the sphere lanes
+};
+
+// Primitive reference used during construction.
+// The builders reorder one array of these in place instead of copying bounding boxes around.
+struct BVHPrimitive {
+    Vector3 centroid;
+    int id;
+};
+
+// boxes[i] is the bounding box of primitive i.
+// The nodes are appended to node_pool and the index of the root is returned.
+// primitive_order receives the primitive ids in leaf order, leaves index into it.
+// Leaves are costed as if their primitives were tested leaf_block at a time (see PrimitivePack).
+int construct_bvh(const std::vector<BBox> &boxes, std::vector<BVHNode> &node_pool, std::vector<int> &primitive_order,
+                  int leaf_block = 1);
+int construct_bvh_sah(const std::vector<BBox> &boxes, std::vector<BVHNode> &node_pool, std::vector<int> &primitive_order,
+                      int leaf_block = 1);
+int construct_lbvh(const std::vector<BBox> &boxes, std::vector<BVHNode> &node_pool, std::vector<int> &primitive_order,
+                   int leaf_block = 1);
+// Returns the bounds of the parts of primitive id below and above the plane p[axis] = pos, clipped to box.
+using SplitPrimitiveFunc = std::function<std::pair<BBox, BBox>(int id, int axis, Real pos, const BBox &box)>;
+// Spatial splits duplicate primitive references, a primitive can appear several times in primitive_order.
+// At most budget * boxes.size() references are added.
+int construct_sbvh(const std::vector<BBox> &boxes, const SplitPrimitiveFunc &split_primitive, Real budget,
+                   std::vector<BVHNode> &node_pool, std::vector<int> &primitive_order, int leaf_block = 1);
+// Expected cost of tracing a random ray through the tree, relative to one primitive intersection.
+Real bvh_sah_cost(const int bvh_root_id, const std::vector<BVHNode> &bvh_nodes);
+// node_slots, if given, receives the index in bvh_nodes of every linear node.
+void flatten_bvh(const int bvh_root_id, const std::vector<BVHNode> &bvh_nodes, std::vector<LinearBVHNode> &linear_nodes,
+                 std::vector<int> *node_slots = nullptr);
+std::optional<ShapeHit> bvh_intersect(const std::vector<LinearBVHNode> &bvh_nodes, const std::vector<Shape> &shapes, const std::vector<TriangleMesh>& meshes, Ray ray);
+// Any-hit query for shadow rays: stops at the first primitive hit in [ray.tmin, ray.tmax].
+bool bvh_occluded(const std::vector<LinearBVHNode> &bvh_nodes, const std::vector<Shape> &shapes, const std::vector<TriangleMesh>& meshes, Ray ray);
+
+// Collapse the binary tree into a wide one by repeatedly opening the largest interior child.
+// node_slots, if given, receives the index in bvh_nodes of child i of wide node j at j * N + i, -1 for empty slots.
+template <int N>
+void collapse_bvh(const int bvh_root_id, const std::vector<BVHNode> &bvh_nodes, std::vector<WideBVHNode<N>> &wide_nodes,
+                  std::vector<int> *node_slots = nullptr);
+template <int N>
+std::optional<ShapeHit> bvh_intersect(const std::vector<WideBVHNode<N>> &bvh_nodes, const std::vector<Shape> &shapes, const std::vector<TriangleMesh>& meshes, Ray ray);
+template <int N>
+bool bvh_occluded(const std::vector<WideBVHNode<N>> &bvh_nodes, const std::vector<Shape> &shapes, const std::vector<TriangleMesh>& meshes, Ray ray);
+template <int N>
+void quantize_bvh(const std::vector<WideBVHNode<N>> &wide_nodes, std::vector<QuantizedBVHNode<N>> &quantized_nodes);
+template <int N>
+std::optional<ShapeHit> bvh_intersect(const std::vector<QuantizedBVHNode<N>> &bvh_nodes, const std::vector<Shape> &shapes, const std::vector<TriangleMesh>& meshes, Ray ray);
+template <int N>
+bool bvh_occluded(const std::vector<QuantizedBVHNode<N>> &bvh_nodes, const std::vector<Shape> &shapes, const std::vector<TriangleMesh>& meshes, Ray ray);
+
+// Rays traced together by the packet queries, a multiple of 4 so that the box tests fill SSE registers.
+constexpr int c_ray_packet_size = 16;
+
+// Binary tree from the builders plus the traversal layout flattened or collapsed from it.
+// The binary tree and node_slots are freed after the build unless BVHBuildOptions::refit is set.
+struct BVH {
+    std::vector<BVHNode> nodes;
+    int root_id = -1;
+    // Bounds of the root node
+    BBox box;
+    // Traversal copy of nodes, only the one matching the width and quantized options passed to build_bvh is built
+    std::vector<LinearBVHNode> linear_nodes;
+    std::vector<BVH4Node> bvh4_nodes;
+    std::vector<BVH8Node> bvh8_nodes;
+    std::vector<QBVH4Node> qbvh4_nodes;
+    std::vector<QBVH8Node> qbvh8_nodes;
+    // Node whose bounds every slot of the traversal layout holds (see flatten_bvh and collapse_bvh)
+    std::vector<int> node_slots;
+    // bvh_sah_cost right after the last build, refits are compared against it
+    Real build_sah_cost = 0;
+    // Only when an SBVH copied shapes into several leaves: index of the first copy of every shape
+    std::vector<int> first_copy;
+    // Only with TriangleStore::Float: one entry per shape, in the same (leaf) order
+    std::vector<PackedTriangle> triangles;
+    // Only with TriangleStore::Simd: the shapes of every leaf with several shapes in consecutive packs,
+    // starting at packs[first_pack[primitive_offset]] for the leaf whose shapes start at primitive_offset
+    std::vector<PrimitivePack> packs;
+    std::vector<int> first_pack;
+};
+
+// Build bvh over shapes, then store the shapes in leaf order (shapes split by an SBVH are copied into every leaf).
+// new_shape_id[i] receives the new index of the shape that was at index i.
+void build_bvh(BVH &bvh, std::vector<Shape> &shapes, const std::vector<TriangleMesh> &meshes,
+               const BVHBuildOptions &options, std::vector<int> &new_shape_id);
+// Recompute the node bounds bottom-up after the shapes moved, keeping the topology, and update the traversal layout.
+// bvh must have been built with BVHBuildOptions::refit.
+void refit_bvh(BVH &bvh, const std::vector<Shape> &shapes, const std::vector<TriangleMesh> &meshes);
+// Refit bvh, or rebuild it when the refitted tree is too much worse than the last built one (see rebuild_threshold).
+// Returns true and fills new_shape_id like build_bvh if it was rebuilt.
+bool update_bvh(BVH &bvh, std::vector<Shape> &shapes, const std::vector<TriangleMesh> &meshes,
+                const BVHBuildOptions &options, std::vector<int> &new_shape_id);
+// Memory taken by the traversal layout of bvh.
+size_t traversal_nodes_bytes(const BVH &bvh);
+// Memory taken by everything bvh holds: the binary tree if kept, the traversal layout and the triangle store.
+size_t bvh_bytes(const BVH &bvh);
+// Queries on whichever traversal layout of bvh is built.
+std::optional<ShapeHit> bvh_intersect(const BVH &bvh, const std::vector<Shape> &shapes, const std::vector<TriangleMesh>& meshes, const Ray &ray);
+bool bvh_occluded(const BVH &bvh, const std::vector<Shape> &shapes, const std::vector<TriangleMesh>& meshes, const Ray &ray);
+// Packet queries for up to c_ray_packet_size coherent rays, such as the camera rays of a pixel block.
+// The rays walk the tree together so that every node is fetched and tested once for all the rays that reach it.
+// Leaves are tested against the shapes themselves whatever the triangle store.
+void bvh_intersect_packet(const BVH &bvh, const std::vector<Shape> &shapes, const std::vector<TriangleMesh>& meshes,
+                          const Ray rays[], int num_rays, std::optional<ShapeHit> hits[]);
+void bvh_occluded_packet(const BVH &bvh, const std::vector<Shape> &shapes, const std::vector<TriangleMesh>& meshes,
+                         const Ray rays[], int num_rays, bool occluded[]);
 
-int construct_bvh(const std::vector<BBoxWithID> &boxes, std::vector<BVHNode> &node_pool);
-std::optional<Intersection> bvh_intersect(const int bvh_root_id, const std::vector<BVHNode> &bvh_nodes, const std::vector<Shape> &shapes, const std::vector<TriangleMesh>& meshes, Ray ray);
\ No newline at end of file
+// Shapes of a Mitsuba <shapegroup> in their local space and the bottom-level BVH over them,
+// shared by every Instance of the group. Triangles reference meshes of the scene.
+struct ShapeGroup {
+    std::vector<Shape> shapes;
+    BVH bvh;
+};
\ No newline at end of file
@@ -175,3 +175,37 @@ void imwrite(const fs::path &filename, const Image3 &image) {
         }
     }
 }
+
+
+ImageDifference image_difference(const Image3 &reference, const Image3 &img, int block_size) {
+    if (reference.width != img.width || reference.height != img.height) {
+        Error("Cannot compare images of different sizes.");
+    }
+    double reference_sum = 0, sum = 0;
+    for (int i = 0; i < (int)img.data.size(); i++) {
+        reference_sum += average(reference(i));
+        sum += average(img(i));
+    }
+    if (!(reference_sum > 0)) {
+        Error("Cannot compare against a black reference.");
+    }
+    double reference_mean = reference_sum / img.data.size();
+    double squared_error = 0;
+    int num_blocks = 0;
+    for (int y0 = 0; y0 < img.height; y0 += block_size) {
+        for (int x0 = 0; x0 < img.width; x0 += block_size) {
+            double difference = 0;
+            int count = 0;
+            for (int y = y0; y < std::min(y0 + block_size, img.height); y++) {
+                for (int x = x0; x < std::min(x0 + block_size, img.width); x++) {
+                    difference += average(img(x, y)) - average(reference(x, y));
+                    count++;
+                }
+            }
+            squared_error += (difference / count) * (difference / count);
+            num_blocks++;
+        }
+    }
+    return ImageDifference{Real((sum - reference_sum) / reference_sum),
+                           Real(std::sqrt(squared_error / num_blocks) / reference_mean)};
+}
\ No newline at end of file
@@ -56,6 +56,16 @@ Image3 imread3(const fs::path &filename);
 /// Supported formats: PFM & exr
 void imwrite(const fs::path &filename, const Image3 &image);
 
+/// How far img is from reference in expectation, for comparing renders whose noise differs
+/// (e.g. the take and take_float builds, which consume random numbers differently).
+/// mean is the relative difference of the average pixel values, block_rmse the RMSE of the averages
+/// over block_size x block_size blocks, relative to the average of the reference.
+struct ImageDifference {
+    Real mean;
+    Real block_rmse;
+};
+ImageDifference image_difference(const Image3 &reference, const Image3 &img, int block_size);
+
 inline Image3 to_image3(const Image1 &img) {
     Image3 out(img.width, img.height);
     std::transform(img.data.cbegin(), img.data.cend(), out.data.begin(),
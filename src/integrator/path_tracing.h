@@ -1,15 +1,20 @@
 #include "scene.h"
+#include "integrator/russian_roulette.h"
 
 // Path tracing with multi-sample version of MIS
 // we deterministically shooting rays for both lights and BRDFs and weighing them.
-Vector3 path_tracing(const Scene& scene, const Ray& ray, std::mt19937& rng){
+// v_ is the first hit of ray, when it was already found (e.g. by scene_intersect_packet).
+Vector3 path_tracing(const Scene& scene, const Ray& ray, const std::optional<Intersection>& v_, Sampler& sampler, BounceHistogram& bounces){
     Ray r = ray;
-    std::optional<Intersection> v_ = scene_intersect(scene, r);
-    if(!v_) return scene.background_color;
+    if(!v_){
+        bounces.add(0);
+        return scene.background_color;
+    }
     Intersection v = *v_;
 
     Vector3 radiance = {Real(0), Real(0), Real(0)};
     Vector3 throughput = {Real(1), Real(1), Real(1)};
+    int num_bounces = 0;
 
     if(v.area_light_id != -1) {
         const Light& light = scene.lights.at(v.area_light_id);
@@ -18,6 +23,8 @@ Vector3 path_tracing(const Scene& scene, const Ray& ray, std::mt19937& rng){
     }
 
     for(int i = 0; i <= scene.options.max_depth; ++i){
+        if(!russian_roulette(scene, i, throughput, sampler))
+            break;
 
         Vector3 dir_in = -r.dir;
         const Material& m = scene.materials[v.material_id];
@@ -28,10 +35,11 @@ Vector3 path_tracing(const Scene& scene, const Ray& ray, std::mt19937& rng){
         // Sampling Light
         Vector3 C1 = Vector3{Real(0), Real(0), Real(0)};
         if(scene.lights.size() > 0 && !is_specular){
-            int light_id = sample_light(scene, rng);
+            start_bounce_dimension(sampler, i, c_dimension_light);
+            int light_id = sample_light(scene, sampler);
             auto light = scene.lights[light_id];
             if (auto* l = std::get_if<DiffuseAreaLight>(&light)) {
-                auto& light_point = sample_on_light(scene, *l, v.pos, rng);
+                auto light_point = sample_on_light(scene, *l, v.pos, sampler);
                 auto& [light_pos, light_n] = light_point;
                 Real d = length(light_pos - v.pos);
                 Vector3 light_dir = normalize(light_pos - v.pos);
@@ -50,7 +58,7 @@ Vector3 path_tracing(const Scene& scene, const Ray& ray, std::mt19937& rng){
                     Vector3 FG = eval(m, dir_in, record, v, scene.textures);
 
                     // TODO Multi light may cause different behavior here, needs to be check
-                    Ray shadow_r = Ray{v.pos, light_dir, c_EPSILON, (1 - c_EPSILON) * d};
+                    Ray shadow_r = spawn_ray_to(v.pos, v.geo_normal, light_pos, light_n);
                     if(!scene_occluded(scene, shadow_r)){
                         C1 = FG * l->intensity * light_pdf / (light_pdf * light_pdf + bsdf_pdf * bsdf_pdf);
                     }
@@ -62,7 +70,8 @@ Vector3 path_tracing(const Scene& scene, const Ray& ray, std::mt19937& rng){
         // Sampling bsdf
         Vector3 C2 = Vector3{Real(0), Real(0), Real(0)};
         Vector3 n = dot(dir_in, v.shading_normal) < 0 ? -v.shading_normal : v.shading_normal;
-        std::optional<SampleRecord> record_ = sample_bsdf(m, dir_in, v, scene.textures, rng);
+        start_bounce_dimension(sampler, i, c_dimension_bsdf);
+        std::optional<SampleRecord> record_ = sample_bsdf(m, dir_in, v, scene.textures, sampler);
         if(!record_){
             // std::cout << "record break" << std::endl;
             break;
@@ -76,8 +85,9 @@ Vector3 path_tracing(const Scene& scene, const Ray& ray, std::mt19937& rng){
             // std::cout << "pdf break" << std::endl;
             break;
         }
-        r = Ray{v.pos, dir_out, c_EPSILON, infinity<Real>()};
+        r = spawn_ray(v.pos, v.geo_normal, dir_out);
         std::optional<Intersection> new_v_ = scene_intersect(scene, r);
+        num_bounces++;
 
         if(!new_v_){
             // std::cout << "bg break" << std::endl;
@@ -107,18 +117,27 @@ Vector3 path_tracing(const Scene& scene, const Ray& ray, std::mt19937& rng){
         throughput *= FG / bsdf_pdf;
         v = *new_v_;
     }
+    bounces.add(num_bounces);
     return radiance;
 }
 
+Vector3 path_tracing(const Scene& scene, const Ray& ray, Sampler& sampler, BounceHistogram& bounces){
+    return path_tracing(scene, ray, scene_intersect(scene, ray), sampler, bounces);
+}
+
 // Path tracing without MIS
-Vector3 path_tracing_raw(const Scene& scene, const Ray& ray, std::mt19937& rng){
+Vector3 path_tracing_raw(const Scene& scene, const Ray& ray, Sampler& sampler, BounceHistogram& bounces){
     Ray r = ray;
     std::optional<Intersection> v_ = scene_intersect(scene, r);
-    if(!v_) return scene.background_color;
+    if(!v_){
+        bounces.add(0);
+        return scene.background_color;
+    }
     Intersection v = *v_;
 
     Vector3 radiance = {Real(0), Real(0), Real(0)};
     Vector3 throughput = {Real(1), Real(1), Real(1)};
+    int num_bounces = 0;
     for(int i = 0; i <= scene.options.max_depth; ++i){
         if(v.area_light_id != -1) {
             const Light& light = scene.lights.at(v.area_light_id);
@@ -127,9 +146,12 @@ Vector3 path_tracing_raw(const Scene& scene, const Ray& ray, std::mt19937& rng){
                 break;
             }
         } else {
+            if(!russian_roulette(scene, i, throughput, sampler))
+                break;
             Vector3 dir_in = -r.dir;
             Vector3 n = dot(dir_in, v.shading_normal) < 0 ? -v.shading_normal : v.shading_normal;
-            std::optional<SampleRecord> record_ = sample_bsdf(scene.materials[v.material_id], dir_in, v, scene.textures, rng);
+            start_bounce_dimension(sampler, i, c_dimension_bsdf);
+            std::optional<SampleRecord> record_ = sample_bsdf(scene.materials[v.material_id], dir_in, v, scene.textures, sampler);
             if(!record_){
                 // std::cout << "record break" << std::endl;
                 break;
@@ -143,8 +165,9 @@ Vector3 path_tracing_raw(const Scene& scene, const Ray& ray, std::mt19937& rng){
                 break;
             }
             throughput *= FG / pdf;
-            r = Ray{v.pos, dir_out, c_EPSILON, infinity<Real>()};
+            r = spawn_ray(v.pos, v.geo_normal, dir_out);
             std::optional<Intersection> v_ = scene_intersect(scene, r);
+            num_bounces++;
             if(!v_){
                 // std::cout << "bg break" << std::endl;
                 radiance += throughput * scene.background_color;
@@ -153,19 +176,24 @@ Vector3 path_tracing_raw(const Scene& scene, const Ray& ray, std::mt19937& rng){
             v = *v_;
         }
     }
+    bounces.add(num_bounces);
     return radiance;
 }
 
 // Path tracing with one-sample variant of MIS
 // instead of deterministically shooting rays for both lights and BRDFs and weighing them, we randomly choose one and combine the distribution.
-Vector3 path_tracing_one_sample_MIS(const Scene& scene, const Ray& ray, std::mt19937& rng){
+Vector3 path_tracing_one_sample_MIS(const Scene& scene, const Ray& ray, Sampler& sampler, BounceHistogram& bounces){
     Ray r = ray;
     std::optional<Intersection> v_ = scene_intersect(scene, r);
-    if(!v_) return scene.background_color;
+    if(!v_){
+        bounces.add(0);
+        return scene.background_color;
+    }
     Intersection v = *v_;
 
     Vector3 radiance = {Real(0), Real(0), Real(0)};
     Vector3 throughput = {Real(1), Real(1), Real(1)};
+    int num_bounces = 0;
     for(int i = 0; i <= scene.options.max_depth; ++i){
         if(v.area_light_id != -1) {
             const Light& light = scene.lights.at(v.area_light_id);
@@ -175,6 +203,8 @@ Vector3 path_tracing_one_sample_MIS(const Scene& scene, const Ray& ray, std::mt1
                 break;
             }
         }
+        if(!russian_roulette(scene, i, throughput, sampler))
+            break;
 
         Vector3 dir_in = -r.dir;
         const Material& m = scene.materials[v.material_id];
@@ -184,12 +214,14 @@ Vector3 path_tracing_one_sample_MIS(const Scene& scene, const Ray& ray, std::mt1
         
         // For mirror, sampling light has no meaning because only the perfect reflection angle will produce non-zero FG
         // If we do NEE it will be inefficient
-        if(scene.lights.size() > 0 && !is_specular && random_real(rng) <= 0.5){
+        start_bounce_dimension(sampler, i, c_dimension_strategy);
+        if(scene.lights.size() > 0 && !is_specular && next_1d(sampler) <= 0.5){
             // Sampling Light
-            int light_id = sample_light(scene, rng);
+            start_bounce_dimension(sampler, i, c_dimension_light);
+            int light_id = sample_light(scene, sampler);
             auto light = scene.lights[light_id];
             if (auto* l = std::get_if<DiffuseAreaLight>(&light)) {
-                auto& light_point = sample_on_light(scene, *l, v.pos, rng);
+                auto light_point = sample_on_light(scene, *l, v.pos, sampler);
                 auto& [light_pos, light_n] = light_point;
                 Real d = length(light_pos - v.pos);
                 Vector3 light_dir = normalize(light_pos - v.pos);
@@ -209,8 +241,9 @@ Vector3 path_tracing_one_sample_MIS(const Scene& scene, const Ray& ray, std::mt1
                 record.dir_out = light_dir;
                 Vector3 FG = eval(m, dir_in, record, v, scene.textures);
 
-                r = Ray{v.pos, light_dir, c_EPSILON, infinity<Real>()};
+                r = spawn_ray(v.pos, v.geo_normal, light_dir);
                 std::optional<Intersection> v_ = scene_intersect(scene, r);
+                num_bounces++;
                 // No need for vertex check cause we will always hit the light or an obstacle
                 // if(!v_){
                 //     // std::cout << "bg break" << std::endl;
@@ -228,7 +261,8 @@ Vector3 path_tracing_one_sample_MIS(const Scene& scene, const Ray& ray, std::mt1
         }else{
             // Sampling bsdf
             Vector3 n = dot(dir_in, v.shading_normal) < 0 ? -v.shading_normal : v.shading_normal;
-            std::optional<SampleRecord> record_ = sample_bsdf(m, dir_in, v, scene.textures, rng);
+            start_bounce_dimension(sampler, i, c_dimension_bsdf);
+            std::optional<SampleRecord> record_ = sample_bsdf(m, dir_in, v, scene.textures, sampler);
             if(!record_){
                 // std::cout << "record break" << std::endl;
                 break;
@@ -241,8 +275,9 @@ Vector3 path_tracing_one_sample_MIS(const Scene& scene, const Ray& ray, std::mt1
                 // std::cout << "pdf break" << std::endl;
                 break;
             }
-            r = Ray{v.pos, dir_out, c_EPSILON, infinity<Real>()};
+            r = spawn_ray(v.pos, v.geo_normal, dir_out);
             std::optional<Intersection> new_v_ = scene_intersect(scene, r);
+            num_bounces++;
 
             Real pdf = (scene.lights.empty() || is_specular) ? bsdf_pdf : Real(0.5) * bsdf_pdf;
 
@@ -267,19 +302,24 @@ Vector3 path_tracing_one_sample_MIS(const Scene& scene, const Ray& ray, std::mt1
             v = *new_v_;
         }
     }
+    bounces.add(num_bounces);
     return radiance;
 }
 
 // Path tracing with one-sample variant of MIS with light picking by power (Seems to have bugs)
-Vector3 path_tracing_one_sample_MIS_power(const Scene& scene, const Ray& ray, std::mt19937& rng){
+Vector3 path_tracing_one_sample_MIS_power(const Scene& scene, const Ray& ray, Sampler& sampler, BounceHistogram& bounces){
     Ray r = ray;
     std::optional<Intersection> v_ = scene_intersect(scene, r);
-    if(!v_) return scene.background_color;
+    if(!v_){
+        bounces.add(0);
+        return scene.background_color;
+    }
     Intersection v = *v_;
 
     Real eta_scale = Real(1);
     Vector3 radiance = {Real(0), Real(0), Real(0)};
     Vector3 throughput = {Real(1), Real(1), Real(1)};
+    int num_bounces = 0;
     for(int i = 0; i <= scene.options.max_depth; ++i){
         if(v.area_light_id != -1) {
             const Light& light = scene.lights.at(v.area_light_id);
@@ -289,6 +329,8 @@ Vector3 path_tracing_one_sample_MIS_power(const Scene& scene, const Ray& ray, st
                 break;
             }
         }
+        if(!russian_roulette(scene, i, throughput, sampler))
+            break;
         
         Vector3 dir_in = -r.dir;
         const Material& m = scene.materials[v.material_id];
@@ -296,12 +338,14 @@ Vector3 path_tracing_one_sample_MIS_power(const Scene& scene, const Ray& ray, st
         if(std::holds_alternative<Plastic>(m) || std::holds_alternative<Mirror>(m))
             is_specular = true;
         
-        if(scene.lights.size() > 0 && !is_specular && random_real(rng) <= 0.5){
+        start_bounce_dimension(sampler, i, c_dimension_strategy);
+        if(scene.lights.size() > 0 && !is_specular && next_1d(sampler) <= 0.5){
             // Sampling Light
-            int light_id = sample_light_power(scene, rng);
+            start_bounce_dimension(sampler, i, c_dimension_light);
+            int light_id = sample_light_power(scene, sampler);
             auto light = scene.lights[light_id];
             if (auto* l = std::get_if<DiffuseAreaLight>(&light)) {
-                auto& light_point = sample_on_light(scene, *l, v.pos, rng);
+                auto light_point = sample_on_light(scene, *l, v.pos, sampler);
                 auto& [light_pos, light_n] = light_point;
                 Real d = length(light_pos - v.pos);
                 Vector3 light_dir = normalize(light_pos - v.pos);
@@ -321,8 +365,9 @@ Vector3 path_tracing_one_sample_MIS_power(const Scene& scene, const Ray& ray, st
                 record.dir_out = light_dir;
                 Vector3 FG = eval(m, dir_in, record, v, scene.textures);
 
-                r = Ray{v.pos, light_dir, c_EPSILON, infinity<Real>()};
+                r = spawn_ray(v.pos, v.geo_normal, light_dir);
                 std::optional<Intersection> v_ = scene_intersect(scene, r);
+                num_bounces++;
                 if(!v_){
                     // std::cout << "bg break" << std::endl;
                     radiance += throughput * scene.background_color;
@@ -337,7 +382,8 @@ Vector3 path_tracing_one_sample_MIS_power(const Scene& scene, const Ray& ray, st
         }else{
             // Sampling bsdf
             Vector3 n = dot(dir_in, v.shading_normal) < 0 ? -v.shading_normal : v.shading_normal;
-            std::optional<SampleRecord> record_ = sample_bsdf(m, dir_in, v, scene.textures, rng);
+            start_bounce_dimension(sampler, i, c_dimension_bsdf);
+            std::optional<SampleRecord> record_ = sample_bsdf(m, dir_in, v, scene.textures, sampler);
             if(!record_){
                 // std::cout << "record break" << std::endl;
                 break;
@@ -350,8 +396,9 @@ Vector3 path_tracing_one_sample_MIS_power(const Scene& scene, const Ray& ray, st
                 // std::cout << "pdf break" << std::endl;
                 break;
             }
-            r = Ray{v.pos, dir_out, c_EPSILON, infinity<Real>()};
+            r = spawn_ray(v.pos, v.geo_normal, dir_out);
             std::optional<Intersection> new_v_ = scene_intersect(scene, r);
+            num_bounces++;
 
             Real pdf = (scene.lights.empty() || is_specular) ? bsdf_pdf : Real(0.5) * bsdf_pdf;
 
@@ -376,5 +423,6 @@ Vector3 path_tracing_one_sample_MIS_power(const Scene& scene, const Ray& ray, st
             v = *new_v_;
         }
     }
+    bounces.add(num_bounces);
     return radiance;
 }
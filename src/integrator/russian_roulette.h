@@ -0,0 +1,46 @@
+#pragma once
+#include "scene.h"
+
+// Russian roulette at the vertex of bounce: from scene.options.rr_depth on, the path goes on with probability
+// min(max(throughput), 1) and its throughput is divided by that probability, which keeps the estimate unbiased.
+// Paths that carry little light end early, bright ones keep going. Returns false when the path ends.
+inline bool russian_roulette(const Scene& scene, int bounce, Vector3& throughput, Sampler& sampler){
+    if(scene.options.rr_depth < 0 || bounce < scene.options.rr_depth)
+        return true;
+    Real p = std::min(max(throughput), Real(1));
+    start_bounce_dimension(sampler, bounce, c_dimension_russian_roulette);
+    if(next_1d(sampler) >= p)
+        return false;
+    throughput /= p;
+    return true;
+}
+
+// Number of paths by the number of rays they traced after the camera ray.
+struct BounceHistogram {
+    std::vector<int64_t> count;
+
+    void add(int bounces) {
+        if(bounces >= (int)count.size())
+            count.resize(bounces + 1, 0);
+        count[bounces]++;
+    }
+    void merge(const BounceHistogram& h) {
+        if(h.count.size() > count.size())
+            count.resize(h.count.size(), 0);
+        for(size_t i = 0; i < h.count.size(); ++i)
+            count[i] += h.count[i];
+    }
+};
+
+inline void print_bounce_histogram(const BounceHistogram& h){
+    int64_t paths = 0, rays = 0;
+    for(int i = 0; i < (int)h.count.size(); ++i){
+        paths += h.count[i];
+        rays += h.count[i] * i;
+    }
+    std::cout << "Bounces per path: " << Real(rays) / std::max(paths, int64_t(1)) << " on average" << std::endl;
+    for(int i = 0; i < (int)h.count.size(); ++i){
+        if(h.count[i] > 0)
+            std::cout << "  " << i << ": " << h.count[i] << " paths (" << Real(100) * h.count[i] / paths << "%)" << std::endl;
+    }
+}
\ No newline at end of file
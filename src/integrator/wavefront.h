@@ -0,0 +1,435 @@
+#include "scene.h"
+#include "integrator/russian_roulette.h"
+#include "utils/timer.h"
+
+// Wavefront version of path_tracing, same estimator.
+// Instead of carrying one path through all of its bounces, every bounce runs one stage at a time
+// (ray sort, intersect, emission, material sort, shade, occlusion) over the queue of all live paths.
+
+// Live paths, one array per field.
+struct PathQueue {
+    std::vector<int> pixel;          // where the radiance of the path goes
+    std::vector<int> packet;         // packet of camera rays the path started in
+    std::vector<Ray> ray;            // next ray to trace
+    std::vector<Vector3> throughput;
+    std::vector<Intersection> v;     // vertex the ray leaves from
+    // BSDF sample that gave ray, to weight the light it hits
+    std::vector<Vector3> FG;
+    std::vector<Real> bsdf_pdf;
+    std::vector<char> is_specular;
+    // Sampler of the path, which follows it through the sorts
+    std::vector<Sampler> sampler;
+
+    int size() const { return (int)pixel.size(); }
+    void clear() {
+        pixel.clear(); packet.clear(); ray.clear(); throughput.clear(); v.clear();
+        FG.clear(); bsdf_pdf.clear(); is_specular.clear(); sampler.clear();
+    }
+    void swap(PathQueue& q) {
+        pixel.swap(q.pixel); packet.swap(q.packet); ray.swap(q.ray); throughput.swap(q.throughput); v.swap(q.v);
+        FG.swap(q.FG); bsdf_pdf.swap(q.bsdf_pdf); is_specular.swap(q.is_specular); sampler.swap(q.sampler);
+    }
+    // Copy path i of queue q to the end of this queue
+    void push(const PathQueue& q, int i) {
+        pixel.push_back(q.pixel[i]); packet.push_back(q.packet[i]); ray.push_back(q.ray[i]); throughput.push_back(q.throughput[i]); v.push_back(q.v[i]);
+        FG.push_back(q.FG[i]); bsdf_pdf.push_back(q.bsdf_pdf[i]); is_specular.push_back(q.is_specular[i]);
+        sampler.push_back(q.sampler[i]);
+    }
+};
+
+// Light samples of the shade stage, contribution is added to pixel when ray is not occluded.
+struct ShadowQueue {
+    std::vector<int> pixel;
+    std::vector<int> packet;
+    std::vector<Ray> ray;
+    std::vector<Vector3> contribution;
+
+    int size() const { return (int)pixel.size(); }
+    void clear() { pixel.clear(); packet.clear(); ray.clear(); contribution.clear(); }
+};
+
+// End of the run of rays from begin on that started in the same packet of camera rays, at most c_ray_packet_size long.
+inline int packet_end(const std::vector<int>& packet, int begin){
+    int end = begin + 1;
+    while(end < (int)packet.size() && end - begin < c_ray_packet_size && packet[end] == packet[begin])
+        ++end;
+    return end;
+}
+
+void wavefront_intersect(const Scene& scene, const PathQueue& paths, int depth,
+                         std::vector<std::optional<Intersection>>& hits){
+    hits.resize(paths.size());
+    if(depth == 0 && scene.options.packets){
+        for(int begin = 0, end; begin < paths.size(); begin = end){
+            end = packet_end(paths.packet, begin);
+            scene_intersect_packet(scene, &paths.ray[begin], end - begin, &hits[begin]);
+        }
+        return;
+    }
+    for(int i = 0; i < paths.size(); ++i)
+        hits[i] = scene_intersect(scene, paths.ray[i]);
+}
+
+// Add the light found at the end of the rays and move the paths that continue to next.
+void wavefront_emission(const Scene& scene, const PathQueue& paths, int depth,
+                        const std::vector<std::optional<Intersection>>& hits,
+                        std::vector<Vector3>& radiance, BounceHistogram& bounces, PathQueue& next){
+    next.clear();
+    for(int i = 0; i < paths.size(); ++i){
+        const std::optional<Intersection>& new_v_ = hits[i];
+        Vector3 throughput = paths.throughput[i];
+        Vector3& L = radiance[paths.pixel[i]];
+        if(depth == 0){
+            if(!new_v_){
+                L += scene.background_color;
+                bounces.add(depth);
+                continue;
+            }
+            if(new_v_->area_light_id != -1) {
+                const Light& light = scene.lights.at(new_v_->area_light_id);
+                if (auto* l = std::get_if<DiffuseAreaLight>(&light))
+                    L += throughput * l->intensity;
+            }
+        }else{
+            const Intersection& v = paths.v[i];
+            const Vector3& FG = paths.FG[i];
+            Real bsdf_pdf = paths.bsdf_pdf[i];
+            if(!new_v_){
+                throughput *= FG / bsdf_pdf;
+                L += throughput * scene.background_color;
+                bounces.add(depth);
+                continue;
+            }
+            if(new_v_->area_light_id != -1){
+                const Vector3 &light_pos = new_v_->pos;
+                Real d = length(light_pos - v.pos);
+                Vector3 light_dir = normalize(light_pos - v.pos);
+                Real light_pdf = get_light_pdf(scene, new_v_->area_light_id, {new_v_->pos, new_v_->geo_normal}, v.pos) * (d * d) / (fmax(dot(-new_v_->geo_normal, light_dir), Real(0)) * scene.lights.size());
+                if(light_pdf <= 0){
+                    bounces.add(depth);
+                    continue;
+                }
+                auto light = scene.lights[new_v_->area_light_id];
+                if (auto* l = std::get_if<DiffuseAreaLight>(&light))
+                    L += throughput * FG * l->intensity * (paths.is_specular[i] ? (1 / bsdf_pdf): (bsdf_pdf / (light_pdf * light_pdf + bsdf_pdf * bsdf_pdf)));
+            }
+            throughput *= FG / bsdf_pdf;
+        }
+        next.push(paths, i);
+        next.throughput.back() = throughput;
+        next.v.back() = *new_v_;
+    }
+}
+
+// Russian roulette on the paths about to be shaded at depth, the survivors go to next.
+void wavefront_russian_roulette(const Scene& scene, PathQueue& paths, int depth, BounceHistogram& bounces, PathQueue& next){
+    next.clear();
+    for(int i = 0; i < paths.size(); ++i){
+        if(!russian_roulette(scene, depth, paths.throughput[i], paths.sampler[i])){
+            bounces.add(depth);
+            continue;
+        }
+        next.push(paths, i);
+    }
+}
+
+// Counting sort of the paths by material_id: order lists the paths so that every material is one contiguous run.
+void wavefront_sort_materials(const Scene& scene, const PathQueue& paths, std::vector<int>& count, std::vector<int>& order){
+    count.assign(scene.materials.size() + 1, 0);
+    for(int i = 0; i < paths.size(); ++i)
+        count[paths.v[i].material_id + 1]++;
+    for(size_t k = 1; k < count.size(); ++k)
+        count[k] += count[k - 1];
+    order.resize(paths.size());
+    for(int i = 0; i < paths.size(); ++i)
+        order[count[paths.v[i].material_id]++] = i;
+}
+
+// Per path arrays of the shade stage, kept from one bounce to the next so that they are only allocated once.
+// Entries are indexed by the position of the path in the shading order.
+struct ShadeBuffers {
+    std::vector<Vector3> dir_in, light_dir, light_intensity, light_FG, FG;
+    std::vector<Real> light_pdf, light_bsdf_pdf;
+    std::vector<PointAndNormal> light_points;
+    std::vector<SampleRecord> light_records, records;
+    std::vector<std::optional<SampleRecord>> samples;
+    // 1 when the light sample ends the path, 2 when it is valid
+    std::vector<char> light_sample;
+    // Vertices and samplers of the paths gathered in material order, for the batched BSDF calls
+    std::vector<Intersection> v;
+    std::vector<Sampler> sampler;
+    // Material sort
+    std::vector<int> count, order;
+
+    void resize(int n) {
+        dir_in.resize(n); light_dir.resize(n); light_intensity.resize(n); light_FG.resize(n); FG.resize(n);
+        light_pdf.resize(n); light_bsdf_pdf.resize(n); light_points.resize(n);
+        light_records.resize(n); records.resize(n); samples.resize(n); light_sample.resize(n);
+    }
+};
+
+// Sample the lights and the BSDFs at the vertices of paths, in queue order or, when order is given, in that order.
+// Every run of paths with the same material goes through each BSDF function in one batched call. The paths that
+// continue go to next with their new ray.
+void wavefront_shade(const Scene& scene, PathQueue& paths, const std::vector<int>* order, int depth, ShadeBuffers& buf,
+                     ShadowQueue& shadows, BounceHistogram& bounces, PathQueue& next){
+    shadows.clear();
+    next.clear();
+    int n = paths.size();
+    buf.resize(n);
+    auto path = [&](int k) { return order ? (*order)[k] : k; };
+    for(int begin = 0, end; begin < n; begin = end){
+        int material_id = paths.v[path(begin)].material_id;
+        for(end = begin + 1; end < n && paths.v[path(end)].material_id == material_id; ++end);
+        int count = end - begin;
+        const Material& m = scene.materials[material_id];
+        // The batched calls read consecutive vertices and samplers, gather them when the paths are not in queue order
+        const Intersection* v = &paths.v[begin];
+        Sampler* sampler = &paths.sampler[begin];
+        if(order){
+            buf.v.resize(count);
+            buf.sampler.resize(count);
+            for(int k = begin; k < end; ++k){
+                buf.v[k - begin] = paths.v[path(k)];
+                buf.sampler[k - begin] = paths.sampler[path(k)];
+            }
+            v = buf.v.data();
+            sampler = buf.sampler.data();
+        }
+        bool is_specular = std::holds_alternative<Plastic>(m) || std::holds_alternative<Mirror>(m);
+        for(int k = begin; k < end; ++k){
+            buf.dir_in[k] = -paths.ray[path(k)].dir;
+            buf.light_sample[k] = 0;
+        }
+
+        // Sampling Light
+        if(scene.lights.size() > 0 && !is_specular){
+            for(int k = begin; k < end; ++k){
+                const Intersection& vi = v[k - begin];
+                Sampler& si = sampler[k - begin];
+                // any direction for the batched calls below when there is no light sample
+                buf.light_dir[k] = vi.shading_normal;
+                start_bounce_dimension(si, depth, c_dimension_light);
+                int light_id = sample_light(scene, si);
+                auto light = scene.lights[light_id];
+                if (auto* l = std::get_if<DiffuseAreaLight>(&light)) {
+                    auto light_point = sample_on_light(scene, *l, vi.pos, si);
+                    auto& [light_pos, light_n] = light_point;
+                    Real d = length(light_pos - vi.pos);
+                    buf.light_dir[k] = normalize(light_pos - vi.pos);
+                    buf.light_pdf[k] = get_light_pdf(scene, light_id, light_point, vi.pos) * (d * d) / (fmax(dot(-light_n, buf.light_dir[k]), Real(0)) * scene.lights.size());
+                    buf.light_points[k] = light_point;
+                    buf.light_intensity[k] = l->intensity;
+                    buf.light_sample[k] = buf.light_pdf[k] <= 0 ? 1 : 2;
+                }
+                buf.light_records[k] = SampleRecord{buf.light_dir[k], Real(0)};
+            }
+            get_bsdf_pdf(m, count, &buf.dir_in[begin], &buf.light_dir[begin], v, scene.textures, &buf.light_bsdf_pdf[begin]);
+            eval(m, count, &buf.dir_in[begin], &buf.light_records[begin], v, scene.textures, &buf.light_FG[begin]);
+        }
+
+        // Sampling bsdf
+        for(int k = begin; k < end; ++k)
+            start_bounce_dimension(sampler[k - begin], depth, c_dimension_bsdf);
+        sample_bsdf(m, count, &buf.dir_in[begin], v, scene.textures, sampler, &buf.samples[begin]);
+        for(int k = begin; k < end; ++k)
+            buf.records[k] = buf.samples[k] ? *buf.samples[k] : SampleRecord{v[k - begin].shading_normal, Real(0)};
+        eval(m, count, &buf.dir_in[begin], &buf.records[begin], v, scene.textures, &buf.FG[begin]);
+        if(order){
+            for(int k = begin; k < end; ++k)
+                paths.sampler[path(k)] = buf.sampler[k - begin];
+        }
+
+        for(int k = begin; k < end; ++k){
+            int i = path(k);
+            if(buf.light_sample[k] == 1){
+                bounces.add(depth);
+                continue;
+            }
+            if(buf.light_sample[k] == 2 && buf.light_bsdf_pdf[k] > 0 && !std::isinf(buf.light_pdf[k])){
+                shadows.pixel.push_back(paths.pixel[i]);
+                shadows.packet.push_back(paths.packet[i]);
+                shadows.ray.push_back(spawn_ray_to(paths.v[i].pos, paths.v[i].geo_normal, buf.light_points[k].position, buf.light_points[k].normal));
+                shadows.contribution.push_back(paths.throughput[i] * buf.light_FG[k] * buf.light_intensity[k] * buf.light_pdf[k] / (buf.light_pdf[k] * buf.light_pdf[k] + buf.light_bsdf_pdf[k] * buf.light_bsdf_pdf[k]));
+            }
+            if(!buf.samples[k] || buf.records[k].pdf <= Real(0)){
+                bounces.add(depth);
+                continue;
+            }
+            next.push(paths, i);
+            next.ray.back() = spawn_ray(paths.v[i].pos, paths.v[i].geo_normal, normalize(buf.records[k].dir_out));
+            next.FG.back() = buf.FG[k];
+            next.bsdf_pdf.back() = buf.records[k].pdf;
+            next.is_specular.back() = is_specular;
+        }
+    }
+}
+
+void wavefront_occlusion(const Scene& scene, const ShadowQueue& shadows, int depth, std::vector<Vector3>& radiance){
+    if(depth == 0 && scene.options.packets){
+        // Shadow rays from the camera hits of one pixel block head for the same lights
+        bool occluded[c_ray_packet_size];
+        for(int begin = 0, end; begin < shadows.size(); begin = end){
+            end = packet_end(shadows.packet, begin);
+            scene_occluded_packet(scene, &shadows.ray[begin], end - begin, occluded);
+            for(int i = begin; i < end; ++i){
+                if(!occluded[i - begin])
+                    radiance[shadows.pixel[i]] += shadows.contribution[i];
+            }
+        }
+        return;
+    }
+    for(int i = 0; i < shadows.size(); ++i){
+        if(!scene_occluded(scene, shadows.ray[i]))
+            radiance[shadows.pixel[i]] += shadows.contribution[i];
+    }
+}
+
+// Cells of the origin grid per axis are 2^c_ray_sort_grid_bits.
+constexpr int c_ray_sort_grid_bits = 4;
+
+static uint32_t spread_bits3(uint32_t x) {
+    uint32_t r = 0;
+    for(int b = 0; b < c_ray_sort_grid_bits; ++b)
+        r |= ((x >> b) & 1u) << (3 * b);
+    return r;
+}
+
+// Counting sort of the paths into buckets of rays going the same way from nearby origins:
+// the direction octant, then the Morton order of the origin on a grid over the bounds of all origins.
+// Rays of a bucket visit mostly the same BVH nodes, so tracing them one after another keeps the nodes in cache.
+void wavefront_sort_rays(const PathQueue& paths, PathQueue& sorted){
+    Vector3 p_min = Vector3{infinity<Real>(), infinity<Real>(), infinity<Real>()};
+    Vector3 p_max = -p_min;
+    for(const Ray& r : paths.ray){
+        p_min = min(p_min, r.origin);
+        p_max = max(p_max, r.origin);
+    }
+    const int cells = 1 << c_ray_sort_grid_bits;
+    Vector3 scale = Vector3{Real(cells), Real(cells), Real(cells)} / max(p_max - p_min, Vector3{c_EPSILON, c_EPSILON, c_EPSILON});
+    std::vector<uint32_t> keys(paths.size());
+    for(int i = 0; i < paths.size(); ++i){
+        const Ray& r = paths.ray[i];
+        uint32_t key = uint32_t(r.dir.x < 0) | uint32_t(r.dir.y < 0) << 1 | uint32_t(r.dir.z < 0) << 2;
+        for(int axis = 0; axis < 3; ++axis){
+            int cell = std::min(int((r.origin[axis] - p_min[axis]) * scale[axis]), cells - 1);
+            key |= spread_bits3(uint32_t(cell)) << (3 + axis);
+        }
+        keys[i] = key;
+    }
+    std::vector<int> count((8 << (3 * c_ray_sort_grid_bits)) + 1, 0);
+    for(uint32_t key : keys)
+        count[key + 1]++;
+    for(size_t k = 1; k < count.size(); ++k)
+        count[k] += count[k - 1];
+    std::vector<int> order(paths.size());
+    for(int i = 0; i < paths.size(); ++i)
+        order[count[keys[i]]++] = i;
+    sorted.clear();
+    for(int i : order)
+        sorted.push(paths, i);
+}
+
+// Work done at one bounce of the wavefront integrator, summed over all batches.
+struct WavefrontBounceStats {
+    int64_t num_rays = 0;
+    Real ray_sort_time = 0;
+    Real intersect_time = 0;
+    int64_t num_hits = 0;
+    Real material_sort_time = 0;
+    Real shade_time = 0;
+};
+
+struct WavefrontStats {
+    std::vector<WavefrontBounceStats> bounces;
+
+    WavefrontBounceStats& at(int depth) {
+        if(depth >= (int)bounces.size())
+            bounces.resize(depth + 1);
+        return bounces[depth];
+    }
+    void merge(const WavefrontStats& stats) {
+        for(int i = 0; i < (int)stats.bounces.size(); ++i){
+            WavefrontBounceStats& b = at(i);
+            const WavefrontBounceStats& o = stats.bounces[i];
+            b.num_rays += o.num_rays;
+            b.ray_sort_time += o.ray_sort_time;
+            b.intersect_time += o.intersect_time;
+            b.num_hits += o.num_hits;
+            b.material_sort_time += o.material_sort_time;
+            b.shade_time += o.shade_time;
+        }
+    }
+};
+
+inline void print_wavefront_stats(const WavefrontStats& stats){
+    for(int i = 0; i < (int)stats.bounces.size(); ++i){
+        const WavefrontBounceStats& b = stats.bounces[i];
+        // rays per second of the traversal alone and including the time spent sorting the rays
+        std::cout << "Bounce " << i << ": " << b.num_rays << " rays, ray sort " << b.ray_sort_time * 1000
+                  << " ms, intersect " << b.intersect_time * 1000 << " ms, "
+                  << b.num_rays / b.intersect_time * 1e-6 << " Mrays/s ("
+                  << b.num_rays / (b.intersect_time + b.ray_sort_time) * 1e-6 << " with the sort); "
+                  << b.num_hits << " hits, material sort " << b.material_sort_time * 1000
+                  << " ms, shading " << b.shade_time * 1000 << " ms" << std::endl;
+    }
+}
+
+// Trace all camera rays together, radiance[pixels[i]] accumulates the radiance along rays[i],
+// whose path draws from samplers[i]. Consecutive rays with the same packets[i] are traced as one packet
+// with -packets, as are the shadow rays of their hits.
+void wavefront_path_tracing(const Scene& scene, const std::vector<Ray>& rays, const std::vector<int>& pixels,
+                            const std::vector<int>& packets, const std::vector<Sampler>& samplers,
+                            std::vector<Vector3>& radiance, WavefrontStats& stats, BounceHistogram& bounces){
+    PathQueue paths, next, sorted;
+    ShadowQueue shadows;
+    ShadeBuffers shade_buffers;
+    std::vector<std::optional<Intersection>> hits;
+    for(int i = 0; i < (int)rays.size(); ++i){
+        paths.pixel.push_back(pixels[i]);
+        paths.packet.push_back(packets[i]);
+        paths.ray.push_back(rays[i]);
+        paths.throughput.push_back(Vector3{Real(1), Real(1), Real(1)});
+        paths.v.push_back(Intersection{});
+        paths.FG.push_back(Vector3{Real(0), Real(0), Real(0)});
+        paths.bsdf_pdf.push_back(Real(0));
+        paths.is_specular.push_back(false);
+        paths.sampler.push_back(samplers[i]);
+    }
+    Timer timer;
+    for(int depth = 0; paths.size() > 0; ++depth){
+        WavefrontBounceStats& bounce = stats.at(depth);
+        bounce.num_rays += paths.size();
+        tick(timer);
+        // Camera rays are coherent already
+        if(depth > 0 && scene.options.ray_sort){
+            wavefront_sort_rays(paths, sorted);
+            paths.swap(sorted);
+            bounce.ray_sort_time += tick(timer);
+        }
+        wavefront_intersect(scene, paths, depth, hits);
+        bounce.intersect_time += tick(timer);
+        wavefront_emission(scene, paths, depth, hits, radiance, bounces, next);
+        // The vertex at depth is shaded by iteration depth of the bounce loop of path_tracing
+        if(depth > scene.options.max_depth){
+            for(int i = 0; i < next.size(); ++i)
+                bounces.add(depth);
+            break;
+        }
+        if(scene.options.rr_depth >= 0 && depth >= scene.options.rr_depth){
+            wavefront_russian_roulette(scene, next, depth, bounces, sorted);
+            next.swap(sorted);
+        }
+        bounce.num_hits += next.size();
+        tick(timer);
+        const std::vector<int>* order = nullptr;
+        if(scene.options.material_sort){
+            wavefront_sort_materials(scene, next, shade_buffers.count, shade_buffers.order);
+            order = &shade_buffers.order;
+            bounce.material_sort_time += tick(timer);
+        }
+        wavefront_shade(scene, next, order, depth, shade_buffers, shadows, bounces, paths);
+        bounce.shade_time += tick(timer);
+        wavefront_occlusion(scene, shadows, depth, radiance);
+    }
+}
\ No newline at end of file
@@ -11,6 +11,14 @@ struct Intersection {
     int area_light_id;
 };
 
+// What traversal keeps of the closest hit so far, the Intersection is only built for the final one.
+struct ShapeHit {
+    Real t;
+    Vector2 uv;          // barycentrics of the second and third vertex for triangles
+    int shape_id;        // index of the shape that was hit
+    int group_shape_id;  // index of the shape inside the group when shape_id is an instance
+};
+
 struct PointAndNormal {
 	Vector3 position;
 	Vector3 normal;
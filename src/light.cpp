@@ -2,13 +2,13 @@
 #include "scene.h"
 #include <algorithm>
 
-int sample_light(const Scene &scene, std::mt19937& rng) {
-    return static_cast<int>(floor(random_real(rng) * scene.lights.size()));
+int sample_light(const Scene &scene, Sampler& sampler) {
+    return static_cast<int>(floor(next_1d(sampler) * scene.lights.size()));
 }
 
-int sample_light_power(const Scene &scene, std::mt19937& rng) {
+int sample_light_power(const Scene &scene, Sampler& sampler) {
     const std::vector<Real> &power_cdf = scene.lights_power_cdf;
-    Real u = random_real(rng);
+    Real u = next_1d(sampler);
     int size = static_cast<int>(power_cdf.size()) - 1;
     assert(size > 0);
     const Real *ptr = std::upper_bound(power_cdf.data(), power_cdf.data() + size + 1, u);
@@ -52,5 +52,5 @@ PointAndNormal sample_on_light_op::operator()(const PointLight &l) const {
 }
 
 PointAndNormal sample_on_light_op::operator()(const DiffuseAreaLight &l) const {
-    return std::visit(sample_on_shape_op{scene.meshes, ref_pos, rng}, scene.shapes.at(l.shape_id));
+    return std::visit(sample_on_shape_op{scene.meshes, ref_pos, sampler}, scene.shapes.at(l.shape_id));
 }
\ No newline at end of file
@@ -24,18 +24,18 @@ struct sample_on_light_op {
 
     const Scene &scene;
     const Vector3 &ref_pos;
-    std::mt19937& rng;
+    Sampler& sampler;
 };
 
 Real light_power(const Scene &scene, const Light &light);
-int sample_light(const Scene &scene, std::mt19937& rng);
-int sample_light_power(const Scene &scene, std::mt19937& rng);
+int sample_light(const Scene &scene, Sampler& sampler);
+int sample_light_power(const Scene &scene, Sampler& sampler);
 Real get_light_pmf(const Scene &scene, int id);
 Real get_light_pdf(const Scene &scene, int light_id,
                    const PointAndNormal &light_point,
                    const Vector3 &ref_pos
 );
 
-inline PointAndNormal sample_on_light(const Scene &scene, const Light& l, const Vector3 &ref_pos, std::mt19937& rng) {
-    return std::visit(sample_on_light_op{scene, ref_pos, rng}, l);
+inline PointAndNormal sample_on_light(const Scene &scene, const Light& l, const Vector3 &ref_pos, Sampler& sampler) {
+    return std::visit(sample_on_light_op{scene, ref_pos, sampler}, l);
 }
\ No newline at end of file
@@ -1,6 +1,7 @@
 #include "render.h"
 #include "image.h"
 #include "parallel.h"
+#include "utils/flexception.h"
 #include <vector>
 #include <string>
 #include <thread>
@@ -8,20 +9,46 @@
 int main(int argc, char *argv[]) {
     std::vector<std::string> parameters;
     int num_threads = std::thread::hardware_concurrency();
+    fs::path output = "image.exr";
+    std::vector<fs::path> compare;
+    Real tolerance = Real(0.01);
+    Real block_tolerance = Real(0.05);
     for (int i = 1; i < argc; ++i) {
         if (std::string(argv[i]) == "-t") {
             num_threads = std::stoi(std::string(argv[++i]));
+        } else if (std::string(argv[i]) == "-o") {
+            output = argv[++i];
+        } else if (std::string(argv[i]) == "-compare") {
+            if (i + 2 >= argc) {
+                Error("-compare needs a reference and an image.");
+            }
+            compare = {argv[i + 1], argv[i + 2]};
+            i += 2;
+        } else if (std::string(argv[i]) == "-tolerance") {
+            tolerance = std::stod(std::string(argv[++i]));
+        } else if (std::string(argv[i]) == "-block_tolerance") {
+            block_tolerance = std::stod(std::string(argv[++i]));
         } else {
             parameters.push_back(std::string(argv[i]));
         }
     }
 
+    if (!compare.empty()) {
+        // Exit code 1 when the mean of the image is off the reference by more than tolerance,
+        // or its blocks by more than block_tolerance (which also catches errors that cancel out in the mean).
+        ImageDifference difference = image_difference(imread3(compare[0]), imread3(compare[1]), 8);
+        std::cout << "Mean difference: " << Real(100) * difference.mean << "%, "
+                  << "RMSE of 8x8 block means: " << Real(100) * difference.block_rmse << "%" << std::endl;
+        bool same = std::fabs(difference.mean) <= tolerance && difference.block_rmse <= block_tolerance;
+        return same ? 0 : 1;
+    }
+
     parallel_init(num_threads);
 
     Image3 img = render(parameters);
-    imwrite("image.exr", img);
+    imwrite(output, img);
 
     parallel_cleanup();
 
     return 0;
-}
+}
\ No newline at end of file
@@ -17,7 +17,7 @@ struct sample_bsdf_op{
     const Vector3 &dir_in;
     const Intersection &v;
     const TexturePool &texture_pool;
-    std::mt19937 &rng;
+    Sampler &sampler;
 };
 
 struct sample_bsdf_pdf_op{
@@ -77,8 +77,8 @@ std::optional<SampleRecord> sample_bsdf(const Material &material,
                                         const Vector3 &dir_in,
                                         const Intersection &v,
                                         const TexturePool &pool,
-                                        std::mt19937 &rng){
-    return std::visit(sample_bsdf_op{dir_in, v, pool, rng}, material);
+                                        Sampler &sampler){
+    return std::visit(sample_bsdf_op{dir_in, v, pool, sampler}, material);
 }
 
 Real get_bsdf_pdf(const Material &material,
@@ -95,4 +95,43 @@ Vector3 eval(const Material &material,
              const Intersection &v,
              const TexturePool &pool){
     return std::visit(eval_material_op{dir_in, record, v, pool}, material);
+}
+
+void sample_bsdf(const Material &material,
+                 int count,
+                 const Vector3 dir_in[],
+                 const Intersection v[],
+                 const TexturePool &pool,
+                 Sampler samplers[],
+                 std::optional<SampleRecord> records[]){
+    std::visit([&](const auto &m){
+        for(int i = 0; i < count; ++i)
+            records[i] = sample_bsdf_op{dir_in[i], v[i], pool, samplers[i]}(m);
+    }, material);
+}
+
+void get_bsdf_pdf(const Material &material,
+                  int count,
+                  const Vector3 dir_in[],
+                  const Vector3 dir_out[],
+                  const Intersection v[],
+                  const TexturePool &pool,
+                  Real pdfs[]){
+    std::visit([&](const auto &m){
+        for(int i = 0; i < count; ++i)
+            pdfs[i] = sample_bsdf_pdf_op{dir_in[i], dir_out[i], v[i], pool}(m);
+    }, material);
+}
+
+void eval(const Material &material,
+          int count,
+          const Vector3 dir_in[],
+          const SampleRecord records[],
+          const Intersection v[],
+          const TexturePool &pool,
+          Vector3 values[]){
+    std::visit([&](const auto &m){
+        for(int i = 0; i < count; ++i)
+            values[i] = eval_material_op{dir_in[i], records[i], v[i], pool}(m);
+    }, material);
 }
\ No newline at end of file
@@ -3,6 +3,7 @@
 #include "vector.h"
 #include "intersection.h"
 #include "texture.h"
+#include "sampler.h"
 
 struct Diffuse {
     Texture reflectance;
@@ -109,7 +110,7 @@ std::optional<SampleRecord> sample_bsdf(
     const Vector3 &dir_in,
     const Intersection &v,
     const TexturePool &pool,
-    std::mt19937 &rng);
+    Sampler &sampler);
 
 Real get_bsdf_pdf(
     const Material &material,
@@ -118,9 +119,39 @@ Real get_bsdf_pdf(
     const Intersection &v,
     const TexturePool &pool);
 
-inline Vector3 sample_hemisphere_cos(std::mt19937& rng) {
-    Real u1 = random_real(rng);
-    Real u2 = random_real(rng);
+// Versions for count hits sharing one material, the material is dispatched once for all of them.
+// Hit i draws its random numbers from samplers[i].
+void sample_bsdf(
+    const Material &material,
+    int count,
+    const Vector3 dir_in[],
+    const Intersection v[],
+    const TexturePool &pool,
+    Sampler samplers[],
+    std::optional<SampleRecord> records[]);
+
+void get_bsdf_pdf(
+    const Material &material,
+    int count,
+    const Vector3 dir_in[],
+    const Vector3 dir_out[],
+    const Intersection v[],
+    const TexturePool &pool,
+    Real pdfs[]);
+
+void eval(
+    const Material &material,
+    int count,
+    const Vector3 dir_in[],
+    const SampleRecord records[],
+    const Intersection v[],
+    const TexturePool &pool,
+    Vector3 values[]);
+
+inline Vector3 sample_hemisphere_cos(Sampler& sampler) {
+    Vector2 u = next_2d(sampler);
+    Real u1 = u.x;
+    Real u2 = u.y;
     
     Real phi = c_TWOPI * u2;
     Real sqrt_u1 = sqrt(std::clamp(u1, Real(0), Real(1)));
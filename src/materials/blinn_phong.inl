@@ -4,8 +4,9 @@ std::optional<SampleRecord> sample_bsdf_op::operator()(const BlinnPhong &m) cons
     }
     Vector3 n = dot(dir_in, v.shading_normal) < 0 ? -v.shading_normal : v.shading_normal;
 
-    Real u1 = random_real(rng);
-    Real u2 = random_real(rng);
+    Vector2 u = next_2d(sampler);
+    Real u1 = u.x;
+    Real u2 = u.y;
 
     Real reciprocal_alpha_1 = 1 / (m.exponent + 1);
     Real phi = c_TWOPI * u2;
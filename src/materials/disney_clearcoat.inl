@@ -4,7 +4,7 @@ std::optional<SampleRecord> sample_bsdf_op::operator()(const DisneyClearcoat &m)
     }
     Vector3 n = dot(dir_in, v.shading_normal) < 0 ? -v.shading_normal : v.shading_normal;
     SampleRecord record;
-    record.dir_out = to_world(n, sample_hemisphere_cos(rng));
+    record.dir_out = to_world(n, sample_hemisphere_cos(sampler));
     if (dot(v.geo_normal, record.dir_out) < 0) 
         record.pdf = Real(0);
     else
@@ -10,12 +10,12 @@ std::optional<SampleRecord> sample_bsdf_op::operator()(const Plastic &m) const {
     Real F0 = pow((eta - 1)/(eta + 1), Real(2));
     Real F = F0 + (1 - F0) * pow(1 - dot(n, reflect_dir), Real(5));
     
-    Real u = random_real(rng);
+    Real u = next_1d(sampler);
     if(u <= F){
         record.dir_out = reflect_dir;
         record.pdf = Real(1);
     }else{
-        record.dir_out = to_world(n, sample_hemisphere_cos(rng));
+        record.dir_out = to_world(n, sample_hemisphere_cos(sampler));
         if (dot(v.geo_normal, record.dir_out) < 0) {
             record.pdf = Real(0);
         }else{
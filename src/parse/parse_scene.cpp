@@ -304,7 +304,7 @@ LookAtXform parse_lookat(pugi::xml_node node,
     return lookat_xform;
 }
 
-std::tuple<Camera, std::string /* output filename */, int /* sample_count */>
+std::tuple<Camera, std::string /* output filename */, int /* sample_count */, SamplerType>
         parse_sensor(pugi::xml_node node,
                      const std::map<std::string, std::string> &default_map) {
     LookAtXform lookat_xform; 
@@ -315,6 +315,7 @@ std::tuple<Camera, std::string /* output filename */, int /* sample_count */>
     FovAxis fov_axis = FovAxis::X;
 
     int sample_count = 16;
+    SamplerType sampler_type = SamplerType::Independent;
 
     std::string type = node.attribute("type").value();
     if (type == "perspective") {
@@ -350,8 +351,16 @@ std::tuple<Camera, std::string /* output filename */, int /* sample_count */>
             std::tie(width, height, filename) = parse_film(child, default_map);
         } else if (std::string(child.name()) == "sampler") {
             std::string name = child.attribute("type").value();
-            if (name != "independent") {
-                std::cerr << "Warning: the renderer currently only supports independent samplers." << std::endl;
+            if (name == "independent") {
+                sampler_type = SamplerType::Independent;
+            } else if (name == "stratified" || name == "multijitter") {
+                sampler_type = SamplerType::Stratified;
+            } else if (name == "sobol" || name == "ldsampler") {
+                sampler_type = SamplerType::Sobol;
+            } else if (name == "halton" || name == "hammersley") {
+                sampler_type = SamplerType::Halton;
+            } else {
+                std::cerr << "Warning: unknown sampler " << name << ", using independent." << std::endl;
             }
             for (auto grand_child : child.children()) {
                 std::string name = grand_child.attribute("name").value();
@@ -382,7 +391,8 @@ std::tuple<Camera, std::string /* output filename */, int /* sample_count */>
                                   lookat_xform.up,
                                   fov},
                            filename,
-                           sample_count);
+                           sample_count,
+                           sampler_type);
 }
 
 Texture parse_texture(pugi::xml_node node,
@@ -734,7 +744,37 @@ void parse_shape(pugi::xml_node node,
                  std::vector<Light> &lights,
                  std::vector<Shape> &shapes,
                  std::vector<TriangleMesh> &meshes,
+                 const std::map<std::string /* name id */, std::shared_ptr<ShapeGroup>> &shape_group_map,
                  const std::map<std::string, std::string> &default_map) {
+    std::string type = node.attribute("type").value();
+    if (type == "instance") {
+        Instance instance;
+        InstanceTransform transform{Matrix4x4::identity(), Matrix4x4::identity()};
+        for (auto child : node.children()) {
+            std::string name = child.name();
+            if (name == "ref") {
+                pugi::xml_attribute id = child.attribute("id");
+                auto it = shape_group_map.find(id.value());
+                if (it == shape_group_map.end()) {
+                    Error(std::string("Shape group reference ") + id.value() + std::string(" not found."));
+                }
+                instance.group = it->second;
+            } else if (name == "transform") {
+                std::string transform_name = child.attribute("name").value();
+                if (transform_name == "toWorld" || transform_name == "to_world") {
+                    transform.to_world = parse_transform(child, default_map);
+                }
+            }
+        }
+        if (!instance.group) {
+            Error("Instance without a shape group reference.");
+        }
+        transform.to_local = inverse(transform.to_world);
+        instance.transform = std::make_shared<InstanceTransform>(transform);
+        shapes.push_back(instance);
+        return;
+    }
+
     // First, parse the material inside the shape and get the material ID.
     int material_id = -1;
     for (auto child : node.children()) {
@@ -779,7 +819,6 @@ void parse_shape(pugi::xml_node node,
             is_emitter = true;
         }
     }
-    std::string type = node.attribute("type").value();
 
     if (type == "sphere") {
         Shape shape;
@@ -966,15 +1005,18 @@ Scene parse_scene(pugi::xml_node node) {
     std::map<std::string /* name id */, Texture> texture_map;
     TexturePool texture_pool;
     std::map<std::string /* name id */, int /* index id */> material_map;
+    std::vector<std::shared_ptr<ShapeGroup>> shape_groups;
+    std::map<std::string /* name id */, std::shared_ptr<ShapeGroup>> shape_group_map;
     Vector3 background_color = Vector3{0.5, 0.5, 0.5};
     int sample_count = 16;
+    SamplerType sampler_type = SamplerType::Independent;
 
     for (auto child : node.children()) {
         std::string name = child.name();
         if (name == "default") {
             parse_default_map(child, default_map);
         } else if (name == "sensor") {
-            std::tie(camera, filename, sample_count) =
+            std::tie(camera, filename, sample_count, sampler_type) =
                 parse_sensor(child, default_map);
         } else if (name == "bsdf") {
             std::string material_name;
@@ -996,7 +1038,38 @@ Scene parse_scene(pugi::xml_node node) {
                         lights,
                         shapes,
                         meshes,
+                        shape_group_map,
                         default_map);
+        } else if (name == "shapegroup") {
+            std::string id = child.attribute("id").value();
+            if (shape_group_map.find(id) != shape_group_map.end()) {
+                Error(std::string("Duplicated shape group ID:") + id);
+            }
+            auto group = std::make_shared<ShapeGroup>();
+            int num_lights = lights.size();
+            for (auto grandchild : child.children()) {
+                if (std::string(grandchild.name()) == "shape") {
+                    // no nested instancing, the map of the outer scene is not passed down
+                    parse_shape(grandchild,
+                                materials,
+                                material_map,
+                                texture_map,
+                                texture_pool,
+                                lights,
+                                group->shapes,
+                                meshes,
+                                {},
+                                default_map);
+                }
+            }
+            if ((int)lights.size() != num_lights) {
+                Error(std::string("Emitters are not supported in shape group ") + id);
+            }
+            if (group->shapes.empty()) {
+                Error(std::string("Empty shape group ") + id);
+            }
+            shape_groups.push_back(group);
+            shape_group_map[id] = group;
         } else if (name == "texture") {
             std::string id = child.attribute("id").value();
             if (texture_map.find(id) != texture_map.end()) {
@@ -1015,11 +1088,12 @@ Scene parse_scene(pugi::xml_node node) {
     return Scene{camera,
                  std::move(shapes),
                  std::move(meshes),
+                 std::move(shape_groups),
                  std::move(lights),
                  std::move(materials),
                  std::move(texture_pool),
                  background_color,
-                 {sample_count, -1},
+                 {sample_count, sampler_type, -1},
                  filename,
                  };
 }
@@ -1,9 +1,61 @@
 #pragma once
 #include "vector.h"
+#include <cstring>
 
 struct Ray {
     Vector3 origin;
     Vector3 dir;
     Real tmin;
     Real tmax;
-};
\ No newline at end of file
+};
+
+// Rays leaving a surface start slightly off it instead of skipping a fixed distance along the ray
+// (Wächter and Binder, "A Fast and Robust Method for Avoiding Self-Intersection", Ray Tracing Gems 2019).
+// The point moves along the geometric normal by a number of ulps of each coordinate, so the offset follows
+// the rounding error of the hit point wherever it is. Coordinates smaller than c_ray_offset_origin,
+// whose ulps are too small to cover the error of the hit computation, move by a fixed distance instead.
+#if defined(TAKE_FLOAT)
+using RealBits = int32_t;
+const Real c_ray_offset_origin = Real(1) / 32;
+const Real c_ray_offset_scale = Real(1) / 65536;
+const Real c_ray_offset_ulps = Real(256);
+#else
+using RealBits = int64_t;
+const Real c_ray_offset_origin = Real(1) / 32;
+const Real c_ray_offset_scale = Real(1) / (int64_t(1) << 30);
+const Real c_ray_offset_ulps = Real(int64_t(1) << 24);
+#endif
+
+// p moved off the surface with geometric normal n, to the side dir points to.
+inline Vector3 offset_ray_origin(const Vector3 &p, const Vector3 &n, const Vector3 &dir) {
+    Vector3 offset_n = dot(n, dir) < 0 ? -n : n;
+    Vector3 out;
+    for (int i = 0; i < 3; i++) {
+        Real x = p[i];
+        if (std::fabs(x) < c_ray_offset_origin) {
+            out[i] = x + c_ray_offset_scale * offset_n[i];
+            continue;
+        }
+        RealBits bits;
+        std::memcpy(&bits, &x, sizeof(Real));
+        RealBits ulps = RealBits(c_ray_offset_ulps * offset_n[i]);
+        bits += x < 0 ? -ulps : ulps;
+        std::memcpy(&x, &bits, sizeof(Real));
+        out[i] = x;
+    }
+    return out;
+}
+
+// Ray leaving the surface point p with geometric normal n in direction dir.
+inline Ray spawn_ray(const Vector3 &p, const Vector3 &n, const Vector3 &dir) {
+    return Ray{offset_ray_origin(p, n, dir), dir, Real(0), infinity<Real>()};
+}
+
+// Ray from the surface point p with normal n to the surface point target with normal target_n,
+// offset at both ends so that it hits neither surface.
+inline Ray spawn_ray_to(const Vector3 &p, const Vector3 &n, const Vector3 &target, const Vector3 &target_n) {
+    Vector3 origin = offset_ray_origin(p, n, target - p);
+    Vector3 end = offset_ray_origin(target, target_n, p - target);
+    Real d = length(end - origin);
+    return Ray{origin, (end - origin) / d, Real(0), d};
+}
\ No newline at end of file
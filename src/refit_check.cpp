@@ -0,0 +1,150 @@
+#include "scene.h"
+#include "parallel.h"
+#include "transform.h"
+#include "parse/parse_scene.h"
+#include <vector>
+#include <string>
+#include <thread>
+
+// Checks update_bvh (and with it refit_bvh) against brute force: twists the meshes of a scene a little more
+// in every frame, updates the BVHs and compares the closest hit and occlusion of random rays with a loop
+// over every shape. Exits with 1 when any ray differs.
+
+// Closest hit among shapes without any BVH, not even the bottom-level ones of the instances.
+static std::optional<ShapeHit> brute_force_intersect(const std::vector<Shape> &shapes,
+                                                     const std::vector<TriangleMesh> &meshes, Ray ray) {
+    ShapeHit h{infinity<Real>(), Vector2{0, 0}, -1, -1};
+    for (int i = 0; i < (int)shapes.size(); ++i) {
+        if (const Instance *inst = std::get_if<Instance>(&shapes[i])) {
+            const Matrix4x4 &to_local = inst->transform->to_local;
+            Ray local{xform_point(to_local, ray.origin), xform_vector(to_local, ray.dir), ray.tmin, ray.tmax};
+            if (std::optional<ShapeHit> local_hit = brute_force_intersect(inst->group->shapes, meshes, local)) {
+                h = ShapeHit{local_hit->t, local_hit->uv, i, local_hit->shape_id};
+                ray.tmax = h.t;
+            }
+        } else if (intersect_shape(shapes[i], meshes, ray, h)) {
+            ray.tmax = h.t;
+            h.shape_id = i;
+        }
+    }
+    if (h.shape_id == -1) {
+        return {};
+    }
+    return h;
+}
+
+// Returns the number of rays whose closest hit or occlusion differed from brute force.
+static int check_update_bvh(Scene &scene, int num_frames, int num_rays) {
+    BBox bounds;
+    std::vector<std::vector<Vector3>> positions;
+    for (const TriangleMesh &mesh : scene.meshes) {
+        positions.push_back(mesh.positions);
+        for (const Vector3 &p : mesh.positions) {
+            bounds = merge(bounds, BBox{p, p});
+        }
+    }
+    if (empty(bounds)) {
+        std::cerr << "The scene has no triangle meshes to move." << std::endl;
+        return 0;
+    }
+    Vector3 center = centroid(bounds), extent = bounds.p_max - bounds.p_min;
+    Real height = std::max(extent.y, c_EPSILON);
+    int mismatches = 0;
+    for (int frame = 1; frame <= num_frames; ++frame) {
+        // Twist the meshes about the vertical axis through the center, more every frame
+        for (size_t k = 0; k < scene.meshes.size(); ++k) {
+            for (size_t i = 0; i < positions[k].size(); ++i) {
+                Vector3 p = positions[k][i] - center;
+                Real angle = Real(0.3) * frame * p.y / height;
+                scene.meshes[k].positions[i] = center + Vector3{p.x * cos(angle) - p.z * sin(angle), p.y,
+                                                                p.x * sin(angle) + p.z * cos(angle)};
+            }
+        }
+        update_bvh(scene);
+        RNG rng = make_rng(uint64_t(frame), scene.options.seed);
+        int frame_mismatches = 0;
+        for (int i = 0; i < num_rays; ++i) {
+            Vector3 origin = center + Vector3{random_real(rng) - Real(0.5), random_real(rng) - Real(0.5),
+                                              random_real(rng) - Real(0.5)} * extent * Real(1.5);
+            Real z = 1 - 2 * random_real(rng), phi = 2 * c_PI * random_real(rng);
+            Real r = sqrt(std::max(1 - z * z, Real(0)));
+            // Hits right at the origin are up to the ray offsets and the float triangle store rejects them
+            Ray ray{origin, Vector3{r * cos(phi), r * sin(phi), z}, Real(1e-3) * length(extent), infinity<Real>()};
+            std::optional<ShapeHit> expected = brute_force_intersect(scene.shapes, scene.meshes, ray);
+            std::optional<Intersection> hit = scene_intersect(scene, ray);
+            // The float triangle store only knows t to float precision
+            bool same = bool(hit) == bool(expected) &&
+                        (!hit || std::fabs(hit->t - expected->t) <= Real(1e-4) * (1 + expected->t));
+            if (expected) {
+                ray.tmax = expected->t * Real(0.99);
+                same = same && scene_occluded(scene, ray) ==
+                                   bool(brute_force_intersect(scene.shapes, scene.meshes, ray));
+            }
+            frame_mismatches += !same;
+        }
+        std::cout << "Frame " << frame << ": " << frame_mismatches << " of " << num_rays
+                  << " rays differ from brute force, SAH cost " << bvh_sah_cost(scene.bvh.root_id, scene.bvh.nodes)
+                  << " (" << scene.bvh.build_sah_cost << " when built)" << std::endl;
+        mismatches += frame_mismatches;
+    }
+    return mismatches;
+}
+
+int main(int argc, char *argv[]) {
+    int num_threads = std::thread::hardware_concurrency();
+    int num_frames = 4;
+    int num_rays = 2000;
+    BVHBuildOptions bvh_options;
+    std::string filename;
+    for (int i = 1; i < argc; ++i) {
+        std::string arg = argv[i];
+        if (arg == "-t") {
+            num_threads = std::stoi(std::string(argv[++i]));
+        } else if (arg == "-frames") {
+            num_frames = std::stoi(std::string(argv[++i]));
+        } else if (arg == "-rays") {
+            num_rays = std::stoi(std::string(argv[++i]));
+        } else if (arg == "-bvh") {
+            std::string method = argv[++i];
+            if (method == "median") {
+                bvh_options.method = BVHBuildMethod::Median;
+            } else if (method == "lbvh") {
+                bvh_options.method = BVHBuildMethod::LBVH;
+            } else if (method == "sbvh") {
+                bvh_options.method = BVHBuildMethod::SBVH;
+            }
+        } else if (arg == "-bvh_width") {
+            bvh_options.width = std::stoi(std::string(argv[++i]));
+        } else if (arg == "-bvh_quantized") {
+            bvh_options.quantized = true;
+        } else if (arg == "-bvh_treelets") {
+            bvh_options.treelets = std::stoi(std::string(argv[++i])) != 0;
+        } else if (arg == "-tri_store") {
+            std::string store = argv[++i];
+            if (store == "float") {
+                bvh_options.triangle_store = TriangleStore::Float;
+            } else if (store == "simd") {
+                bvh_options.triangle_store = TriangleStore::Simd;
+            }
+        } else {
+            filename = arg;
+        }
+    }
+    if (filename.empty()) {
+        std::cerr << "Usage: take_refit_check [-frames <n>] [-rays <n>] [BVH options of take] <scene.xml>" << std::endl;
+        return 1;
+    }
+
+    if (bvh_options.quantized && bvh_options.width == 2) {
+        bvh_options.width = 4;
+    }
+
+    parallel_init(num_threads);
+    Scene scene = parse_scene(filename);
+    bvh_options.refit = true;
+    scene.options.bvh = bvh_options;
+    build_bvh(scene);
+    int mismatches = check_update_bvh(scene, num_frames, num_rays);
+    parallel_cleanup();
+    return mismatches > 0 ? 1 : 0;
+}
\ No newline at end of file
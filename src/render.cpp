@@ -5,6 +5,98 @@
 #include "utils/timer.h"
 #include "utils/progressreporter.h"
 #include "integrator/path_tracing.h"
+#include "integrator/wavefront.h"
+#include <numeric>
+
+// Adaptive sampling spends a quarter of the sample budget, and at least 4 samples per pixel, on a first pass over all pixels.
+// The error estimates need at least 2 samples per pixel, budgets below 4 samples per pixel are raised to the first pass.
+static int adaptive_first_pass_spp(int spp) {
+    return std::max(spp / 4, 4);
+}
+
+// Relative standard error of the mean luminance of a pixel from n >= 2 samples, whose luminance sums to sum
+// and whose squared luminance sums to sq_sum. Means below floor count as floor, so that dark pixels do not look noisy.
+static Real relative_error(int n, Real sum, Real sq_sum, Real floor) {
+    Real mean = sum / n;
+    Real variance = std::max((sq_sum - sum * mean) / (n - 1), Real(0));
+    return sqrt(variance / n) / std::max(mean, floor);
+}
+
+// Sample targets of the next adaptive pass. A pixel is converged when neither its relative error nor that of
+// its neighbours is above target_error. Every other pixel asks for the samples that would bring the error
+// down to target_error, at most doubling its count. When the requests exceed what is left of budget, the
+// unconverged pixels share their samples and the rest of the budget in proportion to the standard deviation
+// of their samples instead, which minimizes the sum of their squared errors.
+// Returns the number of samples of the pass, 0 when there is nothing left to do.
+static int64_t adaptive_sample_targets(int width, int height, Real target_error, int64_t budget,
+                                       const std::vector<int> &sample_count,
+                                       const std::vector<Real> &luminance_sum,
+                                       const std::vector<Real> &luminance_sq_sum,
+                                       std::vector<int> &sample_target,
+                                       int &num_converged) {
+    int num_pixels = width * height;
+    int64_t used = 0;
+    Real total_luminance = 0;
+    for (int p = 0; p < num_pixels; p++) {
+        used += sample_count[p];
+        total_luminance += luminance_sum[p];
+    }
+    // A tenth of the average luminance, whatever the scale of the scene
+    Real floor = Real(0.1) * total_luminance / used;
+    std::vector<Real> error(num_pixels);
+    for (int p = 0; p < num_pixels; p++) {
+        error[p] = relative_error(sample_count[p], luminance_sum[p], luminance_sq_sum[p], floor);
+    }
+    // Relative error of the unconverged pixels, 0 for the converged ones
+    std::vector<Real> pixel_error(num_pixels, Real(0));
+    std::vector<int64_t> wanted(num_pixels, 0);
+    int64_t total_wanted = 0, unconverged_samples = 0;
+    Real total_deviation = 0;
+    num_converged = 0;
+    for (int y = 0; y < height; y++) {
+        for (int x = 0; x < width; x++) {
+            Real e = 0;
+            for (int ny = std::max(y - 1, 0); ny <= std::min(y + 1, height - 1); ny++) {
+                for (int nx = std::max(x - 1, 0); nx <= std::min(x + 1, width - 1); nx++) {
+                    e = std::max(e, error[ny * width + nx]);
+                }
+            }
+            int p = y * width + x;
+            if (e <= target_error) {
+                num_converged++;
+                continue;
+            }
+            pixel_error[p] = e;
+            // The error falls with the square root of the number of samples
+            Real growth = std::min((e / target_error) * (e / target_error), Real(2));
+            wanted[p] = std::max(int64_t(ceil(sample_count[p] * (growth - 1))), int64_t(1));
+            total_wanted += wanted[p];
+            unconverged_samples += sample_count[p];
+            total_deviation += e * sqrt(Real(sample_count[p]));
+        }
+    }
+    int64_t remaining = budget - used;
+    if (total_wanted > remaining) {
+        // Pixel p should end with pool * deviation_p / total_deviation samples
+        Real pool = Real(remaining + unconverged_samples);
+        total_wanted = 0;
+        for (int p = 0; p < num_pixels; p++) {
+            if (pixel_error[p] > 0) {
+                Real share = pool * pixel_error[p] * sqrt(Real(sample_count[p])) / total_deviation;
+                wanted[p] = std::clamp(int64_t(share) - sample_count[p], int64_t(0), wanted[p]);
+                total_wanted += wanted[p];
+            }
+        }
+    }
+    Real scale = total_wanted > remaining ? Real(remaining) / total_wanted : Real(1);
+    int64_t num_samples = 0;
+    for (int p = 0; p < num_pixels; p++) {
+        int n = int(wanted[p] * scale);
+        sample_target[p] = sample_count[p] + n;
+        num_samples += n;
+    }
+    return num_samples;
+}
 
 Image3 render(const std::vector<std::string> &params) {
     if (params.size() < 1) {
@@ -12,10 +104,92 @@ Image3 render(const std::vector<std::string> &params) {
     }
 
     int max_depth = 50;
+    int rr_depth = 5;
+    bool packets = false;
+    Integrator integrator = Integrator::PathTracing;
+    bool material_sort = false;
+    bool ray_sort = true;
+    int wavefront_batch = 1 << 16;
+    uint64_t seed = 0;
+    Real adaptive_error = 0;
+    std::optional<SamplerType> sampler_type;
+    BVHBuildOptions bvh_options;
     std::string filename;
     for (int i = 0; i < (int)params.size(); i++) {
         if (params[i] == "-max_depth") {
             max_depth = std::stoi(params[++i]);
+        } else if (params[i] == "-rr_depth") {
+            rr_depth = std::stoi(params[++i]);
+        } else if (params[i] == "-bvh") {
+            std::string method = params[++i];
+            if (method == "sah") {
+                bvh_options.method = BVHBuildMethod::SAH;
+            } else if (method == "median") {
+                bvh_options.method = BVHBuildMethod::Median;
+            } else if (method == "lbvh") {
+                bvh_options.method = BVHBuildMethod::LBVH;
+            } else if (method == "sbvh") {
+                bvh_options.method = BVHBuildMethod::SBVH;
+            } else {
+                std::cerr << "Unknown BVH build method: " << method << ", using sah." << std::endl;
+            }
+        } else if (params[i] == "-bvh_width") {
+            bvh_options.width = std::stoi(params[++i]);
+            if (bvh_options.width != 2 && bvh_options.width != 4 && bvh_options.width != 8) {
+                std::cerr << "BVH width must be 2, 4 or 8, using 4." << std::endl;
+                bvh_options.width = 4;
+            }
+        } else if (params[i] == "-bvh_quantized") {
+            bvh_options.quantized = true;
+        } else if (params[i] == "-bvh_treelets") {
+            bvh_options.treelets = std::stoi(params[++i]) != 0;
+        } else if (params[i] == "-sbvh_budget") {
+            bvh_options.spatial_split_budget = std::stod(params[++i]);
+        } else if (params[i] == "-tri_store") {
+            std::string store = params[++i];
+            if (store == "mesh") {
+                bvh_options.triangle_store = TriangleStore::Mesh;
+            } else if (store == "float") {
+                bvh_options.triangle_store = TriangleStore::Float;
+            } else if (store == "simd") {
+                bvh_options.triangle_store = TriangleStore::Simd;
+            } else {
+                std::cerr << "Unknown triangle store: " << store << ", using mesh." << std::endl;
+            }
+        } else if (params[i] == "-integrator") {
+            std::string name = params[++i];
+            if (name == "path") {
+                integrator = Integrator::PathTracing;
+            } else if (name == "wavefront") {
+                integrator = Integrator::Wavefront;
+            } else {
+                std::cerr << "Unknown integrator: " << name << ", using path." << std::endl;
+            }
+        } else if (params[i] == "-material_sort") {
+            material_sort = std::stoi(params[++i]) != 0;
+        } else if (params[i] == "-ray_sort") {
+            ray_sort = std::stoi(params[++i]) != 0;
+        } else if (params[i] == "-wavefront_batch") {
+            wavefront_batch = std::stoi(params[++i]);
+        } else if (params[i] == "-packets") {
+            packets = true;
+        } else if (params[i] == "-seed") {
+            seed = std::stoull(params[++i]);
+        } else if (params[i] == "-adaptive") {
+            adaptive_error = std::stod(params[++i]);
+        } else if (params[i] == "-sampler") {
+            std::string name = params[++i];
+            if (name == "independent") {
+                sampler_type = SamplerType::Independent;
+            } else if (name == "stratified") {
+                sampler_type = SamplerType::Stratified;
+            } else if (name == "sobol") {
+                sampler_type = SamplerType::Sobol;
+            } else if (name == "halton") {
+                sampler_type = SamplerType::Halton;
+            } else {
+                std::cerr << "Unknown sampler: " << name << ", using the sampler of the scene." << std::endl;
+            }
         }
         else if (filename.empty()) {
             filename = params[i];
@@ -23,13 +197,29 @@ Image3 render(const std::vector<std::string> &params) {
     }
 
     Timer timer;
-    std::cout << "Parsing and constructing scene " << params[0] << "." << std::endl;
+    std::cout << "Parsing and constructing scene " << filename << "." << std::endl;
     tick(timer);
-    Scene scene = parse_scene(params[0]);
+    Scene scene = parse_scene(filename);
     std::cout << "Scene parsing done. Took " << tick(timer) << " seconds." << std::endl;
     UNUSED(scene);
 
     scene.options.max_depth = max_depth;
+    scene.options.rr_depth = rr_depth;
+    scene.options.integrator = integrator;
+    scene.options.material_sort = material_sort;
+    scene.options.ray_sort = ray_sort;
+    scene.options.wavefront_batch = wavefront_batch;
+    scene.options.packets = packets;
+    scene.options.seed = seed;
+    scene.options.adaptive_error = adaptive_error;
+    if (sampler_type) {
+        scene.options.sampler = *sampler_type;
+    }
+    if (bvh_options.quantized && bvh_options.width == 2) {
+        std::cerr << "Quantized BVH nodes need a width of 4 or 8, using 4." << std::endl;
+        bvh_options.width = 4;
+    }
+    scene.options.bvh = bvh_options;
     Camera& cam = scene.camera;
 
     Image3 img(cam.width, cam.height);
@@ -48,39 +238,177 @@ Image3 render(const std::vector<std::string> &params) {
     tick(timer);
     build_bvh(scene);
     std::cout << "Finish building BVH. Took " << tick(timer) << " seconds." << std::endl;
+    // Bottom-level BVHs of the instanced groups included
+    size_t traversal_bytes = traversal_nodes_bytes(scene.bvh), total_bytes = bvh_bytes(scene.bvh);
+    for (const auto &group : scene.shape_groups) {
+        traversal_bytes += traversal_nodes_bytes(group->bvh);
+        total_bytes += bvh_bytes(group->bvh);
+    }
+    std::cout << "BVH SAH cost: " << scene.bvh.build_sah_cost
+              << ", traversal nodes: " << traversal_bytes / Real(1 << 20) << " MB"
+              << ", total BVH memory: " << total_bytes / Real(1 << 20) << " MB" << std::endl;
 
-    constexpr int tile_size = 16;
+    // Pixel blocks of c_ray_packet_size pixels, whose camera rays are traced together with -packets
+    constexpr int block_size = 4;
+    static_assert(block_size * block_size == c_ray_packet_size);
+    int tile_size = 16;
+    if (scene.options.integrator == Integrator::Wavefront) {
+        // Every tile is one wavefront of about wavefront_batch paths
+        int side = int(sqrt(Real(scene.options.wavefront_batch) / scene.options.spp));
+        tile_size = std::max(side / block_size, 1) * block_size;
+    }
     int num_tiles_x = (img.width + tile_size - 1) / tile_size;
     int num_tiles_y = (img.height + tile_size - 1) / tile_size;
-    ProgressReporter reporter(num_tiles_x * num_tiles_y);
 
+    int num_image_pixels = img.width * img.height;
+    // Every pass takes the samples of every pixel from sample_count up to sample_target
+    std::vector<int> sample_count(num_image_pixels, 0);
+    std::vector<int> sample_target(num_image_pixels, scene.options.spp);
+    std::vector<Vector3> radiance_sum(num_image_pixels, Vector3{ 0, 0, 0 });
+    // Sums of the luminance of the samples and of its square, for the error estimates of adaptive sampling
+    std::vector<Real> luminance_sum(num_image_pixels, Real(0));
+    std::vector<Real> luminance_sq_sum(num_image_pixels, Real(0));
+    auto add_sample = [&](int pixel, const Vector3& L) {
+        radiance_sum[pixel] += L;
+        Real l = luminance(L);
+        luminance_sum[pixel] += l;
+        luminance_sq_sum[pixel] += l * l;
+    };
+    int64_t sample_budget = int64_t(scene.options.spp) * num_image_pixels;
+    if (scene.options.adaptive_error > 0) {
+        int first_pass_spp = adaptive_first_pass_spp(scene.options.spp);
+        std::fill(sample_target.begin(), sample_target.end(), first_pass_spp);
+        sample_budget = std::max(sample_budget, int64_t(first_pass_spp) * num_image_pixels);
+    }
+
+    WavefrontStats wavefront_stats;
+    BounceHistogram bounces;
+    std::mutex stats_mutex;
     std::cout << "Rendering..." << std::endl;
     tick(timer);
-    parallel_for([&](const Vector2i& tile) {
-        std::mt19937 rng{ std::random_device{}() };
-        int x0 = tile[0] * tile_size;
-        int x1 = min(x0 + tile_size, img.width);
-        int y0 = tile[1] * tile_size;
-        int y1 = min(y0 + tile_size, img.height);
-        for (int y = y0; y < y1; y++) {
-            for (int x = x0; x < x1; x++) {
-                Vector3 color = { 0, 0, 0 };
-                for (int i = 0; i < scene.options.spp; i++) {
-                    Ray r = { cam.lookfrom,
-                            normalize(
-                            u * ((x + random_real(rng)) / img.width - Real(0.5)) * viewport_width +
-                            v * ((y + random_real(rng)) / img.height - Real(0.5)) * viewport_height -
-                            w),
-                            c_EPSILON,
-                            infinity<Real>() };
-                    color += path_tracing(scene, r, rng);
+    for (int pass = 0;; pass++) {
+        ProgressReporter reporter(num_tiles_x * num_tiles_y);
+        parallel_for([&](const Vector2i& tile) {
+            int x0 = tile[0] * tile_size;
+            int x1 = min(x0 + tile_size, img.width);
+            int y0 = tile[1] * tile_size;
+            int y1 = min(y0 + tile_size, img.height);
+            // Camera rays of the whole tile and their pixels, for the wavefront integrator
+            std::vector<Ray> tile_rays;
+            std::vector<int> tile_pixels;
+            // Packet of every camera ray, one per block and round
+            std::vector<int> tile_packets;
+            int num_tile_packets = 0;
+            std::vector<Sampler> tile_samplers;
+            WavefrontStats tile_wavefront_stats;
+            BounceHistogram tile_bounces;
+            for (int by = y0; by < y1; by += block_size) {
+                for (int bx = x0; bx < x1; bx += block_size) {
+                    int num_pixels = 0;
+                    int pixels[c_ray_packet_size];
+                    int num_rounds = 0;
+                    for (int y = by; y < min(by + block_size, y1); y++) {
+                        for (int x = bx; x < min(bx + block_size, x1); x++) {
+                            int pixel = y * img.width + x;
+                            pixels[num_pixels++] = pixel;
+                            num_rounds = std::max(num_rounds, sample_target[pixel] - sample_count[pixel]);
+                        }
+                    }
+                    // Round k takes the next sample of every pixel of the block that still needs one
+                    for (int k = 0; k < num_rounds; k++) {
+                        Ray rays[c_ray_packet_size];
+                        Sampler samplers[c_ray_packet_size];
+                        int ray_pixels[c_ray_packet_size];
+                        int num_rays = 0;
+                        for (int j = 0; j < num_pixels; j++) {
+                            int i = sample_count[pixels[j]] + k;
+                            if (i >= sample_target[pixels[j]]) {
+                                continue;
+                            }
+                            int x = pixels[j] % img.width, y = pixels[j] / img.width;
+                            Sampler &sampler = samplers[num_rays];
+                            sampler = make_sampler(scene.options.sampler, scene.options.spp,
+                                                   uint64_t(y) * img.width + x, i, scene.options.seed);
+                            Vector2 offset = next_2d(sampler);
+                            rays[num_rays] = { cam.lookfrom,
+                                    normalize(
+                                    u * ((x + offset.x) / img.width - Real(0.5)) * viewport_width +
+                                    v * ((y + offset.y) / img.height - Real(0.5)) * viewport_height -
+                                    w),
+                                    c_EPSILON,
+                                    infinity<Real>() };
+                            ray_pixels[num_rays++] = pixels[j];
+                        }
+                        if (scene.options.integrator == Integrator::Wavefront) {
+                            tile_rays.insert(tile_rays.end(), rays, rays + num_rays);
+                            tile_pixels.insert(tile_pixels.end(), ray_pixels, ray_pixels + num_rays);
+                            tile_packets.insert(tile_packets.end(), num_rays, num_tile_packets++);
+                            tile_samplers.insert(tile_samplers.end(), samplers, samplers + num_rays);
+                        } else if (scene.options.packets) {
+                            std::optional<Intersection> hits[c_ray_packet_size];
+                            scene_intersect_packet(scene, rays, num_rays, hits);
+                            for (int j = 0; j < num_rays; j++) {
+                                add_sample(ray_pixels[j], path_tracing(scene, rays[j], hits[j], samplers[j], tile_bounces));
+                            }
+                        } else {
+                            for (int j = 0; j < num_rays; j++) {
+                                add_sample(ray_pixels[j], path_tracing(scene, rays[j], samplers[j], tile_bounces));
+                            }
+                        }
+                    }
+                }
+            }
+            if (scene.options.integrator == Integrator::Wavefront) {
+                // Every path gets its own slot of radiance, so that its sample counts on its own in the error estimates
+                std::vector<int> slots(tile_rays.size());
+                std::iota(slots.begin(), slots.end(), 0);
+                std::vector<Vector3> radiance(tile_rays.size(), Vector3{ 0, 0, 0 });
+                wavefront_path_tracing(scene, tile_rays, slots, tile_packets, tile_samplers, radiance, tile_wavefront_stats, tile_bounces);
+                for (size_t i = 0; i < tile_rays.size(); i++) {
+                    add_sample(tile_pixels[i], radiance[i]);
                 }
-                img(x, img.height - y - 1) = color / Real(scene.options.spp);
             }
+            {
+                std::lock_guard<std::mutex> lock(stats_mutex);
+                wavefront_stats.merge(tile_wavefront_stats);
+                bounces.merge(tile_bounces);
+            }
+            for (int y = y0; y < y1; y++) {
+                for (int x = x0; x < x1; x++) {
+                    sample_count[y * img.width + x] = sample_target[y * img.width + x];
+                }
+            }
+            reporter.update(1);
+            }, Vector2i(num_tiles_x, num_tiles_y));
+        std::cout << std::endl;
+        if (scene.options.adaptive_error <= 0) {
+            break;
+        }
+        int num_converged = 0;
+        int64_t num_new_samples = adaptive_sample_targets(img.width, img.height, scene.options.adaptive_error,
+                                                          sample_budget, sample_count, luminance_sum, luminance_sq_sum,
+                                                          sample_target, num_converged);
+        std::cout << "Adaptive pass " << pass << ": " << num_converged << " of " << num_image_pixels
+                  << " pixels converged, " << num_new_samples << " samples in the next pass" << std::endl;
+        // A pass of less than 1% of the budget is not worth going over all tiles again
+        if (num_new_samples * 100 < sample_budget) {
+            break;
         }
-        reporter.update(1);
-        }, Vector2i(num_tiles_x, num_tiles_y));
-    std::cout << std::endl << "Finish building rendering. Took " << tick(timer) << " seconds." << std::endl;
+    }
+    int64_t num_samples = 0;
+    for (int y = 0; y < img.height; y++) {
+        for (int x = 0; x < img.width; x++) {
+            int pixel = y * img.width + x;
+            img(x, img.height - y - 1) = radiance_sum[pixel] / Real(sample_count[pixel]);
+            num_samples += sample_count[pixel];
+        }
+    }
+    std::cout << "Samples: " << num_samples << ", " << Real(num_samples) / num_image_pixels << " per pixel" << std::endl;
+    std::cout << "Finish building rendering. Took " << tick(timer) << " seconds." << std::endl;
+    if (scene.options.integrator == Integrator::Wavefront) {
+        print_wavefront_stats(wavefront_stats);
+    }
+    print_bounce_histogram(bounces);
 
     return img;
 }
\ No newline at end of file
@@ -0,0 +1,242 @@
+#pragma once
+#include "take.h"
+#include "vector.h"
+#include <vector>
+
+// Samplers give the random numbers of one camera sample. Independent draws them from the RNG of the sample,
+// the others spread the samples of every pixel evenly over each dimension:
+// - Stratified: one jittered stratum per sample, the strata shuffled independently per dimension and pixel.
+// - Sobol: the first two Sobol dimensions, Owen scrambled and shuffled per dimension and pixel, for every
+//   dimension or pair of dimensions (Burley 2020, "Practical Hash-based Owen Scrambling").
+//   Best with a power of two samples per pixel.
+// - Halton: the radical inverse in the prime base of the dimension, with the digits Owen scrambled per pixel.
+enum class SamplerType {
+    Independent,
+    Stratified,
+    Sobol,
+    Halton
+};
+
+struct Sampler {
+    SamplerType type;
+    int samples_per_pixel;
+    // Stratified: the 2D strata are strata_x by samples_per_pixel / strata_x
+    int strata_x;
+    int sample_index;
+    uint64_t pixel;
+    uint64_t seed;
+    // Dimension of the next number drawn
+    int dimension;
+    RNG rng;
+};
+
+// Every bounce of a path draws from the same dimensions relative to its first one, so that each decision
+// (light selection, position on the light, BSDF lobe and direction, Russian roulette) is stratified over the samples of a pixel.
+constexpr int c_camera_dimensions = 2;
+constexpr int c_dimension_strategy = 0;    // one-sample MIS: light or BSDF
+constexpr int c_dimension_light = 1;       // which light
+constexpr int c_dimension_light_point = 2; // 2D, point on the light
+constexpr int c_dimension_bsdf = 4;        // 3D, lobe and direction
+constexpr int c_dimension_russian_roulette = 7;
+constexpr int c_bounce_dimensions = 8;
+
+inline void start_bounce_dimension(Sampler &sampler, int bounce, int offset) {
+    sampler.dimension = c_camera_dimensions + bounce * c_bounce_dimensions + offset;
+}
+
+inline Sampler make_sampler(SamplerType type, int samples_per_pixel, uint64_t pixel, int sample_index, uint64_t seed) {
+    int strata_x = 1;
+    for (int s = 1; s * s <= samples_per_pixel; s++) {
+        if (samples_per_pixel % s == 0) {
+            strata_x = s;
+        }
+    }
+    return Sampler{type, samples_per_pixel, strata_x, sample_index, pixel, seed, 0,
+                   make_sample_rng(pixel, sample_index, seed)};
+}
+
+inline uint64_t mix_bits(uint64_t v) {
+    v ^= (v >> 31);
+    v *= 0x7fb5d329728ea185ULL;
+    v ^= (v >> 27);
+    v *= 0x81dadef4bc2dd44dULL;
+    v ^= (v >> 33);
+    return v;
+}
+
+// Hash of the pixel, dimension and seed of the sample, seeding its scrambles and shuffles.
+inline uint64_t dimension_hash(const Sampler &sampler, int dimension) {
+    return mix_bits(mix_bits(mix_bits(sampler.seed) ^ sampler.pixel) ^ uint64_t(dimension));
+}
+
+inline uint32_t reverse_bits32(uint32_t v) {
+    v = (v << 16) | (v >> 16);
+    v = ((v & 0x00ff00ffu) << 8) | ((v & 0xff00ff00u) >> 8);
+    v = ((v & 0x0f0f0f0fu) << 4) | ((v & 0xf0f0f0f0u) >> 4);
+    v = ((v & 0x33333333u) << 2) | ((v & 0xccccccccu) >> 2);
+    v = ((v & 0x55555555u) << 1) | ((v & 0xaaaaaaaau) >> 1);
+    return v;
+}
+
+// Element i of a random permutation of [0, l) chosen by p (Kensler 2013, "Correlated Multi-Jittered Sampling").
+inline uint32_t permutation_element(uint32_t i, uint32_t l, uint32_t p) {
+    uint32_t w = l - 1;
+    w |= w >> 1;
+    w |= w >> 2;
+    w |= w >> 4;
+    w |= w >> 8;
+    w |= w >> 16;
+    do {
+        i ^= p;
+        i *= 0xe170893d;
+        i ^= p >> 16;
+        i ^= (i & w) >> 4;
+        i ^= p >> 8;
+        i *= 0x0929eb3f;
+        i ^= p >> 23;
+        i ^= (i & w) >> 1;
+        i *= 1 | p >> 27;
+        i *= 0x6935fa69;
+        i ^= (i & w) >> 11;
+        i *= 0x74dcb303;
+        i ^= (i & w) >> 2;
+        i *= 0x9e501cc3;
+        i ^= (i & w) >> 2;
+        i *= 0xc860a3df;
+        i &= w;
+        i ^= i >> 5;
+    } while (i >= l);
+    return (i + p) % l;
+}
+
+// Owen scrambling of the bits of x, the most significant first (Laine and Karras 2011, constants by Burley 2020).
+inline uint32_t nested_uniform_scramble(uint32_t x, uint32_t seed) {
+    x = reverse_bits32(x);
+    x += seed;
+    x ^= x * 0x6c50b47cu;
+    x ^= x * 0xb82f1e52u;
+    x ^= x * 0xc7afe638u;
+    x ^= x * 0x8d22f6e6u;
+    return reverse_bits32(x);
+}
+
+// Dimension 0 (van der Corput) or 1 of the Sobol sequence, as a 0.32 fixed point number.
+inline uint32_t sobol_uint32(uint32_t index, int dimension) {
+    if (dimension == 0) {
+        return reverse_bits32(index);
+    }
+    uint32_t x = 0;
+    for (uint32_t v = 1u << 31; index != 0; index >>= 1, v ^= v >> 1) {
+        if (index & 1) {
+            x ^= v;
+        }
+    }
+    return x;
+}
+
+inline Real uint32_to_real(uint32_t x) {
+    return std::min(Real(x) * Real(0x1p-32), c_one_minus_epsilon);
+}
+
+// Stratum of the sample in dimension, among samples_per_pixel strata. Samples past samples_per_pixel
+// start a new permutation every samples_per_pixel samples.
+inline int sample_stratum(const Sampler &sampler, uint64_t hash) {
+    uint32_t round = uint32_t(sampler.sample_index / sampler.samples_per_pixel);
+    uint32_t i = uint32_t(sampler.sample_index % sampler.samples_per_pixel);
+    return int(permutation_element(i, uint32_t(sampler.samples_per_pixel), uint32_t(mix_bits(hash ^ round))));
+}
+
+constexpr int c_halton_dimensions = 1000;
+
+inline const std::vector<int> &halton_primes() {
+    static const std::vector<int> primes = [] {
+        std::vector<int> p;
+        for (int n = 2; (int)p.size() < c_halton_dimensions; n++) {
+            bool is_prime = true;
+            for (int q : p) {
+                if (q * q > n) {
+                    break;
+                }
+                if (n % q == 0) {
+                    is_prime = false;
+                    break;
+                }
+            }
+            if (is_prime) {
+                p.push_back(n);
+            }
+        }
+        return p;
+    }();
+    return primes;
+}
+
+// Radical inverse of a in base, every digit permuted by a hash of the digits before it.
+// Past the last digit of a the permuted digits are uniform, so they are filled with one hashed number.
+inline Real owen_scrambled_radical_inverse(int base, uint64_t a, uint64_t hash) {
+    Real inv_base = Real(1) / base, inv_base_m = 1;
+    uint64_t reversed_digits = 0;
+    while (a != 0 && inv_base_m > Real(0x1p-32)) {
+        uint64_t next = a / base;
+        uint32_t digit = uint32_t(a - next * base);
+        digit = permutation_element(digit, uint32_t(base), uint32_t(mix_bits(hash ^ reversed_digits)));
+        reversed_digits = reversed_digits * base + digit;
+        inv_base_m *= inv_base;
+        a = next;
+    }
+    Real tail = uint32_to_real(uint32_t(mix_bits(hash ^ reversed_digits) >> 32));
+    return std::min(inv_base_m * (Real(reversed_digits) + tail), c_one_minus_epsilon);
+}
+
+inline Real halton_sample(const Sampler &sampler, int dimension) {
+    const std::vector<int> &primes = halton_primes();
+    return owen_scrambled_radical_inverse(primes[dimension % c_halton_dimensions],
+                                          uint64_t(sampler.sample_index), dimension_hash(sampler, dimension));
+}
+
+inline Real next_1d(Sampler &sampler) {
+    int dimension = sampler.dimension++;
+    switch (sampler.type) {
+    case SamplerType::Stratified: {
+        int stratum = sample_stratum(sampler, dimension_hash(sampler, dimension));
+        return (stratum + random_real(sampler.rng)) / sampler.samples_per_pixel;
+    }
+    case SamplerType::Sobol: {
+        uint64_t hash = dimension_hash(sampler, dimension);
+        uint32_t index = nested_uniform_scramble(uint32_t(sampler.sample_index), uint32_t(hash));
+        return uint32_to_real(nested_uniform_scramble(sobol_uint32(index, 0), uint32_t(hash >> 32)));
+    }
+    case SamplerType::Halton:
+        return halton_sample(sampler, dimension);
+    default:
+        return random_real(sampler.rng);
+    }
+}
+
+inline Vector2 next_2d(Sampler &sampler) {
+    int dimension = sampler.dimension;
+    sampler.dimension += 2;
+    switch (sampler.type) {
+    case SamplerType::Stratified: {
+        int stratum = sample_stratum(sampler, dimension_hash(sampler, dimension));
+        int strata_y = sampler.samples_per_pixel / sampler.strata_x;
+        Real x = (stratum % sampler.strata_x + random_real(sampler.rng)) / sampler.strata_x;
+        Real y = (stratum / sampler.strata_x + random_real(sampler.rng)) / strata_y;
+        return Vector2{x, y};
+    }
+    case SamplerType::Sobol: {
+        uint64_t hash = dimension_hash(sampler, dimension);
+        uint32_t index = nested_uniform_scramble(uint32_t(sampler.sample_index), uint32_t(hash));
+        uint64_t scramble = mix_bits(hash);
+        return Vector2{uint32_to_real(nested_uniform_scramble(sobol_uint32(index, 0), uint32_t(hash >> 32))),
+                       uint32_to_real(nested_uniform_scramble(sobol_uint32(index, 1), uint32_t(scramble)))};
+    }
+    case SamplerType::Halton:
+        return Vector2{halton_sample(sampler, dimension), halton_sample(sampler, dimension + 1)};
+    default: {
+        Real x = random_real(sampler.rng);
+        Real y = random_real(sampler.rng);
+        return Vector2{x, y};
+    }
+    }
+}
\ No newline at end of file
@@ -2,63 +2,89 @@
 #include "parse/parse_scene.h"
 
 void build_bvh(Scene& scene) {
-    std::vector<BBoxWithID> bboxes(scene.shapes.size());
-    for (int i = 0; i < (int)bboxes.size(); i++) {
-        if (auto *sph = std::get_if<Sphere>(&scene.shapes[i])) {
-            Vector3 p_min = sph->center - sph->radius;
-            Vector3 p_max = sph->center + sph->radius;
-            bboxes[i] = {BBox{p_min, p_max}, i};
-        } else if (auto *tri = std::get_if<Triangle>(&scene.shapes[i])) {
-            const TriangleMesh &mesh = scene.meshes[tri->mesh_id];
-            Vector3i index = mesh.indices[tri->face_id];
-            Vector3 p0 = mesh.positions[index[0]];
-            Vector3 p1 = mesh.positions[index[1]];
-            Vector3 p2 = mesh.positions[index[2]];
-            Vector3 p_min = min(min(p0, p1), p2);
-            Vector3 p_max = max(max(p0, p1), p2);
-            bboxes[i] = {BBox{p_min, p_max}, i};
+    // Bottom-level BVHs first, the bounds of the instances in the scene depend on them.
+    std::vector<int> new_shape_id;
+    for (auto &group : scene.shape_groups) {
+        build_bvh(group->bvh, group->shapes, scene.meshes, scene.options.bvh, new_shape_id);
+    }
+    build_bvh(scene.bvh, scene.shapes, scene.meshes, scene.options.bvh, new_shape_id);
+    for (Light &light : scene.lights) {
+        if (auto *l = std::get_if<DiffuseAreaLight>(&light)) {
+            l->shape_id = new_shape_id[l->shape_id];
+        }
+    }
+}
+
+void update_bvh(Scene& scene) {
+    std::vector<int> new_shape_id;
+    for (auto &group : scene.shape_groups) {
+        update_bvh(group->bvh, group->shapes, scene.meshes, scene.options.bvh, new_shape_id);
+    }
+    if (update_bvh(scene.bvh, scene.shapes, scene.meshes, scene.options.bvh, new_shape_id)) {
+        for (Light &light : scene.lights) {
+            if (auto *l = std::get_if<DiffuseAreaLight>(&light)) {
+                l->shape_id = new_shape_id[l->shape_id];
+            }
         }
     }
-    scene.bvh_root_id = construct_bvh(bboxes, scene.bvh_nodes);
 }
 
 std::optional<Intersection> scene_intersect(const Scene& scene, const Ray& r){
-    if(!scene.bvh_nodes.empty()){
-        return bvh_intersect(scene.bvh_root_id, scene.bvh_nodes, scene.shapes, scene.meshes, r);
-        // Intersection v;
-        // scene.bvh->intersect(r, v);
-        // return v;
+    std::optional<ShapeHit> hit;
+    if(scene.bvh.root_id != -1){
+        hit = bvh_intersect(scene.bvh, scene.shapes, scene.meshes, r);
     }else{
         // Traverse
-        Real t = infinity<Real>();
-        Intersection v = {};
-        for(auto& s:scene.shapes){
-            std::optional<Intersection> v_ = std::visit(intersect_op{scene.meshes, r}, s);
-            if(v_ && v_->t < t){
-                t = v_->t;
-                v = *v_;
+        Ray ray = r;
+        ShapeHit h{infinity<Real>(), Vector2{0, 0}, -1, -1};
+        for(int i = 0; i < (int)scene.shapes.size(); ++i){
+            if(intersect_shape(scene.shapes[i], scene.meshes, ray, h)){
+                ray.tmax = h.t;
+                h.shape_id = i;
             }
         }
-        if(t < infinity<Real>())
-            return v;
-        else
-            return {};
+        if(h.shape_id != -1)
+            hit = h;
     }
+    // Only the closest hit pays for normals, uvs and material lookups
+    if(!hit)
+        return {};
+    return get_intersection(scene.shapes[hit->shape_id], scene.meshes, r, *hit);
 }
 
 bool scene_occluded(const Scene& scene, const Ray& r){
-    if(!scene.bvh_nodes.empty()){
-        std::optional<Intersection> v_ = bvh_intersect(scene.bvh_root_id, scene.bvh_nodes, scene.shapes, scene.meshes, r);
-        return v_ ? true : false;
-        // Intersection v;
-        // return scene.bvh->intersect(r, v);
+    if(scene.bvh.root_id != -1){
+        return bvh_occluded(scene.bvh, scene.shapes, scene.meshes, r);
     }else{
-        Real t = infinity<Real>();
         for(auto& s:scene.shapes){
-            std::optional<Intersection> v_ = std::visit(intersect_op{scene.meshes, r}, s);
-            if(v_ && v_->t < t)
-                t = v_->t;
+            if(std::visit(occluded_op{scene.meshes, r}, s))
+                return true;
         }
-        return t < infinity<Real>();
+        return false;
+    }
+}
+
+void scene_intersect_packet(const Scene& scene, const Ray rays[], int num_rays, std::optional<Intersection> hits[]){
+    if(scene.bvh.root_id == -1){
+        for(int i = 0; i < num_rays; ++i)
+            hits[i] = scene_intersect(scene, rays[i]);
+        return;
+    }
+    std::optional<ShapeHit> shape_hits[c_ray_packet_size];
+    bvh_intersect_packet(scene.bvh, scene.shapes, scene.meshes, rays, num_rays, shape_hits);
+    for(int i = 0; i < num_rays; ++i){
+        if(shape_hits[i])
+            hits[i] = get_intersection(scene.shapes[shape_hits[i]->shape_id], scene.meshes, rays[i], *shape_hits[i]);
+        else
+            hits[i] = {};
+    }
+}
+
+void scene_occluded_packet(const Scene& scene, const Ray rays[], int num_rays, bool occluded[]){
+    if(scene.bvh.root_id == -1){
+        for(int i = 0; i < num_rays; ++i)
+            occluded[i] = scene_occluded(scene, rays[i]);
+        return;
     }
+    bvh_occluded_packet(scene.bvh, scene.shapes, scene.meshes, rays, num_rays, occluded);
 }
\ No newline at end of file
@@ -5,9 +5,32 @@
 #include "bvh.h"
 #include "camera.h"
 
+enum class Integrator {
+    PathTracing,
+    Wavefront
+};
+
 struct RenderOptions {
     int spp = 4;
+    SamplerType sampler = SamplerType::Independent;
     int max_depth = -1;
+    // Bounce from which Russian roulette ends paths of low throughput, -1 never
+    int rr_depth = 5;
+    Integrator integrator = Integrator::PathTracing;
+    // Wavefront integrator: sort the hits by material before shading them
+    bool material_sort = false;
+    // Wavefront integrator: bucket the secondary rays by direction and origin before tracing them
+    bool ray_sort = true;
+    // Wavefront integrator: number of paths traced together
+    int wavefront_batch = 1 << 16;
+    // Trace the camera rays of every 4x4 pixel block, and with the wavefront integrator their shadow rays, as one packet (see scene_intersect_packet)
+    bool packets = false;
+    // Mixed into the random numbers of every sample, renders with the same seed are identical
+    uint64_t seed = 0;
+    // Adaptive sampling: relative error of the pixels to stop at, spp becomes the average number of samples
+    // per pixel; 0 takes spp samples in every pixel
+    Real adaptive_error = 0;
+    BVHBuildOptions bvh;
 };
 
 struct Scene {
@@ -17,6 +40,7 @@ struct Scene {
     Camera camera;
     std::vector<Shape> shapes;
     std::vector<TriangleMesh> meshes;
+    std::vector<std::shared_ptr<ShapeGroup>> shape_groups;
     std::vector<Light> lights;
     std::vector<Material> materials;
     TexturePool textures;
@@ -28,18 +52,24 @@ struct Scene {
     std::vector<Real> lights_power_pmf;
     std::vector<Real> lights_power_cdf;
 
-    std::vector<BVHNode> bvh_nodes;
-    int bvh_root_id;
+    // Top-level BVH over shapes, instances in it hold the bottom-level BVHs of shape_groups
+    BVH bvh;
 };
 
 std::optional<Intersection> scene_intersect(const Scene& scene, const Ray& r);
 bool scene_occluded(const Scene& scene, const Ray& r);
+// Up to c_ray_packet_size coherent rays at once (see bvh_intersect_packet).
+void scene_intersect_packet(const Scene& scene, const Ray rays[], int num_rays, std::optional<Intersection> hits[]);
+void scene_occluded_packet(const Scene& scene, const Ray rays[], int num_rays, bool occluded[]);
 void build_bvh(Scene& scene);
+// Call after moving the vertices of scene.meshes without changing their topology, instead of build_bvh.
+// Refits the BVHs and only rebuilds those whose quality dropped too far. Needs scene.options.bvh.refit.
+void update_bvh(Scene& scene);
 
 inline void debug_log(Scene& scene) {
     
-    printf("scene.bvh_nodes[0].left_node_id: %d\n", scene.bvh_nodes[0].left_node_id);
-    printf("scene.bvh_root_id: %d\n", scene.bvh_root_id);
+    printf("scene.bvh.nodes[0].left_node_id: %d\n", scene.bvh.nodes[0].left_node_id);
+    printf("scene.bvh.root_id: %d\n", scene.bvh.root_id);
 
     Light &l = scene.lights[0];
     if (auto* ll = std::get_if<PointLight>(&l))
@@ -1,4 +1,7 @@
 #include "shape.h"
+#include "bvh.h"
+#include "transform.h"
+#include "utils/flexception.h"
 
 Vector2 get_sphere_uv(const Vector3& p) {
     // p: a given point on the sphere of radius one, centered at the origin.
@@ -10,108 +13,182 @@ Vector2 get_sphere_uv(const Vector3& p) {
     return {u, v};
 }
 
-std::optional<Intersection> intersect_op::operator()(const Sphere& s) const {
+// Nearest root of the ray-sphere quadratic in [r.tmin, r.tmax].
+// The discriminant comes from the distance between the center and the closest point of the line instead of
+// b^2 - ac, and the roots from c / q and q / a, which avoids the cancellations that make small or distant
+// spheres miss in single precision (Haines et al., "Precision Improvements for Ray/Sphere Intersection", 2019).
+static bool intersect_sphere(const Sphere& s, const Ray& r, Real& t) {
     Vector3 oc = r.origin - s.center;
     Real a = dot(r.dir, r.dir);
     Real half_b = dot(oc, r.dir);
     Real c = dot(oc, oc) - s.radius*s.radius;
+    Vector3 l = oc - (half_b / a) * r.dir;
 
-    Real discriminant = half_b*half_b - a*c;
+    Real discriminant = a * (s.radius*s.radius - dot(l, l));
     if (discriminant < 0) 
-        return {};
+        return false;
     Real sqrtd = sqrt(discriminant);
 
-    Real root = (-half_b - sqrtd) / a;
+    Real q = -(half_b < 0 ? half_b - sqrtd : half_b + sqrtd);
+    Real near_root = c / q, far_root = q / a;
+    if (far_root < near_root)
+        std::swap(near_root, far_root);
+    Real root = near_root;
     if (root < r.tmin || r.tmax < root) {
-        root = (-half_b + sqrtd) / a;
+        root = far_root;
         if (root < r.tmin || r.tmax < root)
-            return {};
+            return false;
     }
-
-    Intersection v;
-    v.t = root;
-    v.pos = r.origin + r.dir * v.t;
-    v.geo_normal = normalize(v.pos - s.center);
-    v.geo_normal = dot(r.dir, v.geo_normal) < 0 ? v.geo_normal : -v.geo_normal;
-    v.shading_normal = v.geo_normal;
-    v.material_id = s.material_id;
-    v.uv = get_sphere_uv(v.geo_normal);
-    v.area_light_id = s.area_light_id;
-
-    return v;
+    t = root;
+    return true;
 }
 
-std::optional<Intersection> intersect_op::operator()(const Triangle& tri) const {
-    const TriangleMesh &mesh = meshes[tri.mesh_id];
-    const Vector3i &indices = mesh.indices.at(tri.face_id);
-
-    Vector3 v0 = mesh.positions.at(indices.x);
-    Vector3 v1 = mesh.positions.at(indices.y);
-    Vector3 v2 = mesh.positions.at(indices.z);
+// Möller–Trumbore, returns the hit distance and the barycentrics of v1 and v2
+static bool intersect_triangle(const Vector3& v0, const Vector3& v1, const Vector3& v2, const Ray& r,
+                               Real& t, Real& u, Real& v) {
     Vector3 e1, e2, h, s, q;
-    Real a, f, u, v;
+    Real a, f;
     e1 = v1 - v0;
     e2 = v2 - v0;
     h = cross(r.dir, e2);
     a = dot(e1, h);
 
     if (a > -c_EPSILON && a < c_EPSILON)
-        return {};    // This ray is parallel to this triangle.
+        return false;    // This ray is parallel to this triangle.
 
     f = Real(1.0) / a;
     s = r.origin - v0;
     u = f * dot(s, h);
 
     if (u < 0.0 || u > 1.0)
-        return {};
+        return false;
 
     q = cross(s, e1);
     v = f * dot(r.dir, q);
 
     if (v < 0.0 || u + v > 1.0)
-        return {};
+        return false;
 
     // At this stage we can compute t to find out where the intersection point is on the line.
-    Real t = f * dot(e2, q);
-
-    if (t < r.tmin || r.tmax < t) // ray intersection
-        return {};
-    else {
-        Intersection inter;
-        inter.t = t;
-        inter.pos = r.origin + r.dir * t;
-        inter.geo_normal = normalize(cross(e1, e2));
-        inter.geo_normal = dot(r.dir, inter.geo_normal) < 0 ? inter.geo_normal : -inter.geo_normal;
-        inter.material_id = mesh.material_id;
-        inter.area_light_id = tri.area_light_id;
-        // Compute uv
-        if (mesh.uvs.empty()) {
-            inter.uv = Vector2(u, v);
-        } else {
-            Vector2 uv0 = mesh.uvs.at(indices.x);
-            Vector2 uv1 = mesh.uvs.at(indices.y);
-            Vector2 uv2 = mesh.uvs.at(indices.z);
-            inter.uv = (1 - u - v) * uv0 + u * uv1 + v * uv2;
-            // if(inter.uv.y == 1 || inter.uv.y == 0){
-            //     std::cout << uv0 << uv1 << uv2 << std::endl;
-            // }
-        }
-        // Compute shading normal
-        if (mesh.normals.empty()) {
-            inter.shading_normal = inter.geo_normal;
-        } else {
-            Vector3 n0 = mesh.normals.at(indices.x);
-            Vector3 n1 = mesh.normals.at(indices.y);
-            Vector3 n2 = mesh.normals.at(indices.z);
-            inter.shading_normal = normalize((1 - u - v) * n0 + u * n1 + v * n2);
-        }
-        return inter;
+    t = f * dot(e2, q);
+
+    return !(t < r.tmin || r.tmax < t);
+}
+
+bool intersect_op::operator()(const Sphere& s) const {
+    return intersect_sphere(s, r, hit.t);
+}
+
+bool intersect_op::operator()(const Triangle& tri) const {
+    const TriangleMesh &mesh = meshes[tri.mesh_id];
+    const Vector3i &indices = mesh.indices[tri.face_id];
+    // The test writes its outputs before rejecting, keep them away from the current hit
+    Real t, u, v;
+    if (!intersect_triangle(mesh.positions[indices.x], mesh.positions[indices.y], mesh.positions[indices.z],
+                            r, t, u, v))
+        return false;
+    hit.t = t;
+    hit.uv = Vector2{u, v};
+    return true;
+}
+
+Intersection get_intersection_op::operator()(const Sphere& s) const {
+    Intersection v;
+    v.t = hit.t;
+    v.pos = r.origin + r.dir * v.t;
+    v.geo_normal = normalize(v.pos - s.center);
+    v.geo_normal = dot(r.dir, v.geo_normal) < 0 ? v.geo_normal : -v.geo_normal;
+    v.shading_normal = v.geo_normal;
+    v.material_id = s.material_id;
+    v.uv = get_sphere_uv(v.geo_normal);
+    v.area_light_id = s.area_light_id;
+    return v;
+}
+
+Intersection get_intersection_op::operator()(const Triangle& tri) const {
+    const TriangleMesh &mesh = meshes[tri.mesh_id];
+    const Vector3i &indices = mesh.indices[tri.face_id];
+    Vector3 v0 = mesh.positions[indices.x];
+    Vector3 v1 = mesh.positions[indices.y];
+    Vector3 v2 = mesh.positions[indices.z];
+    Real u = hit.uv.x, v = hit.uv.y;
+
+    Intersection inter;
+    inter.t = hit.t;
+    // From the barycentrics rather than t, which the float triangle store only knows to float precision:
+    // the point stays on the triangle to within the rounding of its vertices, as the ray offsets expect.
+    inter.pos = (1 - u - v) * v0 + u * v1 + v * v2;
+    inter.geo_normal = normalize(cross(v1 - v0, v2 - v0));
+    inter.geo_normal = dot(r.dir, inter.geo_normal) < 0 ? inter.geo_normal : -inter.geo_normal;
+    inter.material_id = mesh.material_id;
+    inter.area_light_id = tri.area_light_id;
+    // Compute uv
+    if (mesh.uvs.empty()) {
+        inter.uv = Vector2(u, v);
+    } else {
+        Vector2 uv0 = mesh.uvs[indices.x];
+        Vector2 uv1 = mesh.uvs[indices.y];
+        Vector2 uv2 = mesh.uvs[indices.z];
+        inter.uv = (1 - u - v) * uv0 + u * uv1 + v * uv2;
+    }
+    // Compute shading normal
+    if (mesh.normals.empty()) {
+        inter.shading_normal = inter.geo_normal;
+    } else {
+        Vector3 n0 = mesh.normals[indices.x];
+        Vector3 n1 = mesh.normals[indices.y];
+        Vector3 n2 = mesh.normals[indices.z];
+        inter.shading_normal = normalize((1 - u - v) * n0 + u * n1 + v * n2);
     }
+    return inter;
+}
+
+// Rays are moved into the group's space without normalizing the direction, so t is the same in both spaces.
+static Ray to_local(const Instance& inst, const Ray& r) {
+    const Matrix4x4 &to_local = inst.transform->to_local;
+    return Ray{xform_point(to_local, r.origin), xform_vector(to_local, r.dir), r.tmin, r.tmax};
+}
+
+bool intersect_op::operator()(const Instance& inst) const {
+    std::optional<ShapeHit> local_hit = bvh_intersect(inst.group->bvh, inst.group->shapes, meshes, to_local(inst, r));
+    if (!local_hit) {
+        return false;
+    }
+    hit.t = local_hit->t;
+    hit.uv = local_hit->uv;
+    hit.group_shape_id = local_hit->shape_id;
+    return true;
+}
+
+Intersection get_intersection_op::operator()(const Instance& inst) const {
+    Ray local_ray = to_local(inst, r);
+    Intersection v = get_intersection(inst.group->shapes[hit.group_shape_id], meshes, local_ray, hit);
+    const Matrix4x4 &to_local = inst.transform->to_local;
+    v.pos = xform_point(inst.transform->to_world, v.pos);
+    v.geo_normal = xform_normal(to_local, v.geo_normal);
+    v.shading_normal = xform_normal(to_local, v.shading_normal);
+    return v;
+}
+
+bool occluded_op::operator()(const Sphere& s) const {
+    Real t;
+    return intersect_sphere(s, r, t);
+}
+
+bool occluded_op::operator()(const Triangle& tri) const {
+    const TriangleMesh &mesh = meshes[tri.mesh_id];
+    const Vector3i &indices = mesh.indices[tri.face_id];
+    Real t, u, v;
+    return intersect_triangle(mesh.positions[indices.x], mesh.positions[indices.y], mesh.positions[indices.z], r, t, u, v);
+}
+
+bool occluded_op::operator()(const Instance& inst) const {
+    return bvh_occluded(inst.group->bvh, inst.group->shapes, meshes, to_local(inst, r));
 }
 
 // PointAndNormal sample_on_shape_op::operator()(const Sphere &s) const {
-//     Real u1 = random_real(rng);
-//     Real u2 = random_real(rng);
+//     Real u1 = next_1d(sampler);
+//     Real u2 = next_1d(sampler);
     
 //     Vector3 normal = normalize(Vector3{
 //         2 * cos(2 * c_PI * u2) * sqrt(u1 * (1 - u1)),
@@ -123,8 +200,9 @@ std::optional<Intersection> intersect_op::operator()(const Triangle& tri) const
 // }
 
 PointAndNormal sample_on_shape_op::operator()(const Sphere &s) const {
-    Real u1 = random_real(rng);
-    Real u2 = random_real(rng);
+    Vector2 u = next_2d(sampler);
+    Real u1 = u.x;
+    Real u2 = u.y;
 
     Real r = s.radius;
     Real d = length(s.center - ref_pos);
@@ -143,6 +221,11 @@ PointAndNormal sample_on_shape_op::operator()(const Sphere &s) const {
     return {point, normal};
 }
 
+PointAndNormal sample_on_shape_op::operator()(const Instance &inst) const {
+    UNUSED(inst);
+    Error("Instances cannot be area lights.");
+}
+
 PointAndNormal sample_on_shape_op::operator()(const Triangle &t) const {
     const TriangleMesh &mesh = meshes[t.mesh_id];
     const Vector3i &indices = mesh.indices.at(t.face_id);
@@ -151,8 +234,9 @@ PointAndNormal sample_on_shape_op::operator()(const Triangle &t) const {
     Vector3 v1 = mesh.positions.at(indices.y);
     Vector3 v2 = mesh.positions.at(indices.z);
 
-    Real u1 = random_real(rng);
-    Real u2 = random_real(rng);
+    Vector2 u = next_2d(sampler);
+    Real u1 = u.x;
+    Real u2 = u.y;
 
     Real b1 = 1 - sqrt(u1);
     Real b2 = sqrt(u1) * u2;
@@ -181,4 +265,79 @@ Real get_area_op::operator()(const Triangle &t) const {
     Vector3 v2 = mesh.positions.at(indices.z);
 
     return length(cross(v1 - v0, v2 - v0)) / 2;
+}
+
+Real get_area_op::operator()(const Instance &inst) const {
+    UNUSED(inst);
+    Error("Area of an instance is not supported.");
+}
+
+BBox get_bbox_op::operator()(const Sphere &s) const {
+    return BBox{s.center - s.radius, s.center + s.radius};
+}
+
+BBox get_bbox_op::operator()(const Triangle &t) const {
+    const TriangleMesh &mesh = meshes[t.mesh_id];
+    Vector3i index = mesh.indices[t.face_id];
+    Vector3 p0 = mesh.positions[index[0]];
+    Vector3 p1 = mesh.positions[index[1]];
+    Vector3 p2 = mesh.positions[index[2]];
+    return BBox{min(min(p0, p1), p2), max(max(p0, p1), p2)};
+}
+
+BBox get_bbox_op::operator()(const Instance &inst) const {
+    // Bound the eight transformed corners of the group's box
+    const BBox &local = inst.group->bvh.box;
+    BBox box;
+    for (int i = 0; i < 8; i++) {
+        Vector3 corner{i & 1 ? local.p_max.x : local.p_min.x,
+                       i & 2 ? local.p_max.y : local.p_min.y,
+                       i & 4 ? local.p_max.z : local.p_min.z};
+        Vector3 p = xform_point(inst.transform->to_world, corner);
+        box = merge(box, BBox{p, p});
+    }
+    return box;
+}
+
+// Cut the box itself at the plane
+static std::pair<BBox, BBox> split_box(const BBox &box, int axis, Real pos) {
+    BBox left = box, right = box;
+    left.p_max[axis] = std::min(left.p_max[axis], pos);
+    right.p_min[axis] = std::max(right.p_min[axis], pos);
+    return {overlap(left, box), overlap(right, box)};
+}
+
+std::pair<BBox, BBox> split_bbox_op::operator()(const Sphere &s) const {
+    UNUSED(s);
+    return split_box(box, axis, pos);
+}
+
+std::pair<BBox, BBox> split_bbox_op::operator()(const Triangle &t) const {
+    const TriangleMesh &mesh = meshes[t.mesh_id];
+    Vector3i index = mesh.indices[t.face_id];
+    Vector3 p[3] = {mesh.positions[index[0]], mesh.positions[index[1]], mesh.positions[index[2]]};
+    // Every vertex goes to the side it is on, and every edge crossing the plane adds its crossing point to both.
+    BBox left, right;
+    for (int i = 0; i < 3; i++) {
+        const Vector3 &v0 = p[i];
+        const Vector3 &v1 = p[(i + 1) % 3];
+        if (v0[axis] <= pos) {
+            left = merge(left, BBox{v0, v0});
+        }
+        if (v0[axis] >= pos) {
+            right = merge(right, BBox{v0, v0});
+        }
+        if ((v0[axis] < pos && pos < v1[axis]) || (v1[axis] < pos && pos < v0[axis])) {
+            Vector3 q = v0 + (v1 - v0) * ((pos - v0[axis]) / (v1[axis] - v0[axis]));
+            q[axis] = pos;
+            left = merge(left, BBox{q, q});
+            right = merge(right, BBox{q, q});
+        }
+    }
+    return {overlap(left, box), overlap(right, box)};
+}
+
+std::pair<BBox, BBox> split_bbox_op::operator()(const Instance &inst) const {
+    UNUSED(inst);
+    return split_box(box, axis, pos);
 }
\ No newline at end of file
@@ -1,9 +1,14 @@
 #pragma once
 #include <variant>
 #include <optional>
+#include <memory>
 #include "vector.h"
+#include <vector>
+#include "matrix.h"
 #include "intersection.h"
 #include "ray.h"
+#include "sampler.h"
+#include "bbox.h"
 
 struct ShapeBase {
     int material_id = -1;
@@ -27,42 +32,119 @@ struct Triangle : public ShapeBase {
     int mesh_id;
 };
 
+struct ShapeGroup; // see bvh.h
+
+struct InstanceTransform {
+    Matrix4x4 to_world;
+    Matrix4x4 to_local;
+};
+
+// A transformed copy of a shape group. The group's shapes, meshes and BVH are shared by all its instances,
+// so an instance only costs one node in the scene BVH.
+struct Instance : public ShapeBase {
+    std::shared_ptr<const ShapeGroup> group;
+    std::shared_ptr<const InstanceTransform> transform;
+};
+
 Vector2 get_sphere_uv(const Vector3& p);
 
-using Shape = std::variant<Sphere, Triangle>;
+using Shape = std::variant<Sphere, Triangle, Instance>;
 
+// Nearest hit in [r.tmin, r.tmax], only fills the t, uv and group_shape_id of hit.
 struct intersect_op {
-    std::optional<Intersection> operator()(const Sphere &s) const;
-    std::optional<Intersection> operator()(const Triangle &s) const;
+    bool operator()(const Sphere &s) const;
+    bool operator()(const Triangle &s) const;
+    bool operator()(const Instance &s) const;
+
+    const std::vector<TriangleMesh>& meshes;
+    const Ray& r;
+    ShapeHit& hit;
+};
+
+inline bool intersect_shape(const Shape& shape, const std::vector<TriangleMesh>& meshes, const Ray& r, ShapeHit& hit){
+    return std::visit(intersect_op{meshes, r, hit}, shape);
+}
+
+// Full hit attributes from a hit of r found by intersect_op.
+struct get_intersection_op {
+    Intersection operator()(const Sphere &s) const;
+    Intersection operator()(const Triangle &s) const;
+    Intersection operator()(const Instance &s) const;
 
     const std::vector<TriangleMesh>& meshes;
     const Ray& r;
+    const ShapeHit& hit;
 };
 
-inline std::optional<Intersection> intersect_shape(const Shape& shape, const std::vector<TriangleMesh>& meshes, const Ray& r){
-    return std::visit(intersect_op{meshes, r}, shape);
+inline Intersection get_intersection(const Shape& shape, const std::vector<TriangleMesh>& meshes, const Ray& r, const ShapeHit& hit){
+    return std::visit(get_intersection_op{meshes, r, hit}, shape);
+}
+
+// Only tells whether the ray hits the shape in [r.tmin, r.tmax], no hit attributes are computed.
+struct occluded_op {
+    bool operator()(const Sphere &s) const;
+    bool operator()(const Triangle &s) const;
+    bool operator()(const Instance &s) const;
+
+    const std::vector<TriangleMesh>& meshes;
+    const Ray& r;
+};
+
+inline bool occluded_shape(const Shape& shape, const std::vector<TriangleMesh>& meshes, const Ray& r){
+    return std::visit(occluded_op{meshes, r}, shape);
 }
 
 struct sample_on_shape_op {
     PointAndNormal operator()(const Sphere &s) const;
     PointAndNormal operator()(const Triangle &s) const;
+    PointAndNormal operator()(const Instance &s) const;
 
     const std::vector<TriangleMesh>& meshes;
     const Vector3 &ref_pos;
-    std::mt19937& rng;
+    Sampler& sampler;
 };
 
-inline PointAndNormal sample_on_shape(const Shape& shape, const std::vector<TriangleMesh>& meshes, const Vector3 &ref_pos, std::mt19937& rng) {
-    return std::visit(sample_on_shape_op{meshes, ref_pos, rng}, shape);
+inline PointAndNormal sample_on_shape(const Shape& shape, const std::vector<TriangleMesh>& meshes, const Vector3 &ref_pos, Sampler& sampler) {
+    return std::visit(sample_on_shape_op{meshes, ref_pos, sampler}, shape);
 }
 
 struct get_area_op {
     Real operator()(const Sphere &s) const;
     Real operator()(const Triangle &s) const;
+    Real operator()(const Instance &s) const;
 
     const std::vector<TriangleMesh>& meshes;
 };
 
 inline Real get_area(const Shape& shape, const std::vector<TriangleMesh>& meshes) {
     return std::visit(get_area_op{meshes}, shape);
+}
+
+struct get_bbox_op {
+    BBox operator()(const Sphere &s) const;
+    BBox operator()(const Triangle &s) const;
+    BBox operator()(const Instance &s) const;
+
+    const std::vector<TriangleMesh>& meshes;
+};
+
+inline BBox get_bbox(const Shape& shape, const std::vector<TriangleMesh>& meshes) {
+    return std::visit(get_bbox_op{meshes}, shape);
+}
+
+// Bounds of the parts of the shape below and above the plane p[axis] = pos, clipped to box.
+// Used by spatial splits, only triangles are actually clipped.
+struct split_bbox_op {
+    std::pair<BBox, BBox> operator()(const Sphere &s) const;
+    std::pair<BBox, BBox> operator()(const Triangle &s) const;
+    std::pair<BBox, BBox> operator()(const Instance &s) const;
+
+    const std::vector<TriangleMesh>& meshes;
+    int axis;
+    Real pos;
+    const BBox &box;
+};
+
+inline std::pair<BBox, BBox> split_bbox(const Shape& shape, const std::vector<TriangleMesh>& meshes, int axis, Real pos, const BBox &box) {
+    return std::visit(split_bbox_op{meshes, axis, pos, box}, shape);
 }
\ No newline at end of file
@@ -11,7 +11,6 @@
 #include <iostream>
 #include <limits>
 #include <algorithm>
-#include <random>
 
 // for suppressing unused warnings
 #define UNUSED(x) (void)(x)
@@ -22,10 +21,13 @@
 // put emphasis on the absolute performance. 
 // We choose double so that we do not need to worry about
 // numerical accuracy as much when we render.
-// Switching to floating point computation is easy --
-// just set Real = float.
+// The take_float target defines TAKE_FLOAT to render with Real = float,
+// which halves the memory of the geometry, textures and images.
+#if defined(TAKE_FLOAT)
+using Real = float;
+#else
 using Real = double;
-// using Real = float;
+#endif
 
 const Real c_EPSILON = Real(1e-7);
 // const Real c_EPSILON = Real(1e-4);
@@ -86,10 +88,66 @@ inline Real degrees(const Real rad) {
     return (Real(180) / c_PI) * rad;
 }
 
-inline Real random_real(std::mt19937 &rng) {
-    return std::uniform_real_distribution<Real>{0.0, 1.0}(rng);
+// PCG32 random number generator (O'Neill 2014): 16 bytes of state and a few instructions per number.
+// Every camera sample draws from its own generator, seeded from its pixel, its index and the render seed
+// (see make_sample_rng), so that renders do not depend on the number of threads or the order of the tiles.
+struct RNG {
+    uint64_t state;
+    uint64_t inc;
+};
+
+constexpr uint64_t c_pcg32_mult = 0x5851f42d4c957f2dULL;
+
+inline uint32_t next_uint32(RNG &rng) {
+    uint64_t old_state = rng.state;
+    rng.state = old_state * c_pcg32_mult + rng.inc;
+    uint32_t xorshifted = uint32_t(((old_state >> 18u) ^ old_state) >> 27u);
+    uint32_t rot = uint32_t(old_state >> 59u);
+    return (xorshifted >> rot) | (xorshifted << ((~rot + 1u) & 31));
 }
 
-inline int random_int(int min, int max, std::mt19937 &rng) {
+// Generator of stream sequence, one of 2^63 independent ones, starting at an offset given by seed.
+inline RNG make_rng(uint64_t sequence, uint64_t seed) {
+    RNG rng{0, (sequence << 1u) | 1u};
+    next_uint32(rng);
+    rng.state += seed;
+    next_uint32(rng);
+    return rng;
+}
+
+// Skip delta numbers in O(log delta) steps (Brown 1994, "Random Number Generation with Arbitrary Strides").
+inline void advance(RNG &rng, uint64_t delta) {
+    uint64_t cur_mult = c_pcg32_mult, cur_plus = rng.inc, acc_mult = 1u, acc_plus = 0u;
+    while (delta > 0) {
+        if (delta & 1) {
+            acc_mult *= cur_mult;
+            acc_plus = acc_plus * cur_mult + cur_plus;
+        }
+        cur_plus = (cur_mult + 1) * cur_plus;
+        cur_mult *= cur_mult;
+        delta /= 2;
+    }
+    rng.state = acc_mult * rng.state + acc_plus;
+}
+
+// Numbers reserved for one camera sample, far more than a path of any depth draws.
+constexpr uint64_t c_rng_sample_stride = 1 << 16;
+
+// Generator of sample sample_index of pixel: the stream of the pixel, skipped to the sample's own range.
+inline RNG make_sample_rng(uint64_t pixel, uint64_t sample_index, uint64_t seed) {
+    RNG rng = make_rng(pixel, seed);
+    advance(rng, sample_index * c_rng_sample_stride);
+    return rng;
+}
+
+// Largest Real below 1
+constexpr Real c_one_minus_epsilon = Real(1) - std::numeric_limits<Real>::epsilon() / 2;
+
+// Uniform in [0, 1), from 32 random bits in both precisions. Rounding to float can reach 1, which is clamped.
+inline Real random_real(RNG &rng) {
+    return std::min(Real(next_uint32(rng)) * Real(0x1p-32), c_one_minus_epsilon);
+}
+
+inline int random_int(int min, int max, RNG &rng) {
     return static_cast<int>(min + (max - min) * random_real(rng));
 }
\ No newline at end of file
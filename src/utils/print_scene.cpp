@@ -63,6 +63,9 @@ std::ostream& operator<<(std::ostream &os, const Shape &shape) {
               "area_light_id=" << sphere->area_light_id << ", " <<
               "center=" << sphere->center << ", " <<
               "radius=" << sphere->radius << "]";
+    } else if (auto *instance = std::get_if<Instance>(&shape)) {
+        os << "Instance, " <<
+              "num_shapes=" << instance->group->shapes.size() << "]";
     // } else if (auto *triangle_mesh = std::get_if<TriangleMesh>(&shape)) {
     //     os << "TriangleMesh, " << 
     //           "material_id=" << triangle_mesh->material_id << ", " << 